@@ -0,0 +1,157 @@
+/* dcache.c: Cache of directory lookups.
+ *
+ * Each entry maps a name in a directory, identified by the sector of
+ * its inode, to the sector of the named file's inode, or to 0 if the
+ * name is known not to exist.  dir_add() and dir_remove() keep the
+ * entries of the directory they change up to date, so cached results
+ * are never stale.  At most DCACHE_SIZE entries are kept; the least
+ * recently used one makes room for a new one. */
+
+#include "filesys/dcache.h"
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Most entries cached. */
+#define DCACHE_SIZE 128
+
+/* A cached lookup. */
+struct dentry {
+	struct hash_elem elem;              /* Element in dcache. */
+	struct list_elem lru_elem;          /* Element in dcache_lru. */
+	disk_sector_t parent;               /* Directory's inode sector. */
+	char name[NAME_MAX + 1];            /* Name looked up. */
+	disk_sector_t sector;               /* File's inode sector, or 0. */
+};
+
+static struct hash dcache;
+static struct list dcache_lru;          /* Least recently used first. */
+static size_t dentry_cnt;
+static struct lock dcache_lock;
+
+static struct dentry *dcache_find (disk_sector_t parent, const char *name);
+static uint64_t dentry_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool dentry_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED);
+
+void
+dcache_init (void) {
+	hash_init (&dcache, dentry_hash, dentry_less, NULL);
+	list_init (&dcache_lru);
+	lock_init (&dcache_lock);
+}
+
+/* Looks up NAME in the directory whose inode is in PARENT.  Returns
+ * false if the result is not cached.  Otherwise stores the sector of
+ * the file's inode, or 0 if there is no such file, in *SECTORP. */
+bool
+dcache_lookup (disk_sector_t parent, const char *name,
+		disk_sector_t *sectorp) {
+	lock_acquire (&dcache_lock);
+	struct dentry *d = dcache_find (parent, name);
+	if (d != NULL) {
+		list_remove (&d->lru_elem);
+		list_push_back (&dcache_lru, &d->lru_elem);
+		*sectorp = d->sector;
+	}
+	lock_release (&dcache_lock);
+	return d != NULL;
+}
+
+/* Records that NAME in the directory whose inode is in PARENT names
+ * the inode in SECTOR, or, if SECTOR is 0, nothing.  Unless OVERWRITE
+ * is true, an entry already cached for NAME is kept: it was recorded
+ * by a change to the directory that a lookup racing with it may not
+ * have seen. */
+void
+dcache_insert (disk_sector_t parent, const char *name, disk_sector_t sector,
+		bool overwrite) {
+	struct dentry *d, *victim = NULL;
+
+	if (strlen (name) > NAME_MAX)
+		return;
+
+	lock_acquire (&dcache_lock);
+	d = dcache_find (parent, name);
+	if (d != NULL && !overwrite) {
+		lock_release (&dcache_lock);
+		return;
+	} else if (d != NULL) {
+		list_remove (&d->lru_elem);
+	} else {
+		d = malloc (sizeof *d);
+		if (d == NULL) {
+			lock_release (&dcache_lock);
+			return;
+		}
+		d->parent = parent;
+		strlcpy (d->name, name, sizeof d->name);
+		hash_insert (&dcache, &d->elem);
+		if (++dentry_cnt > DCACHE_SIZE) {
+			victim = list_entry (list_pop_front (&dcache_lru),
+					struct dentry, lru_elem);
+			hash_delete (&dcache, &victim->elem);
+			dentry_cnt--;
+		}
+	}
+	d->sector = sector;
+	list_push_back (&dcache_lru, &d->lru_elem);
+	lock_release (&dcache_lock);
+	free (victim);
+}
+
+/* Drops every entry for names in the directory whose inode is in
+ * PARENT, which is going away. */
+void
+dcache_purge (disk_sector_t parent) {
+	struct list_elem *e;
+
+	lock_acquire (&dcache_lock);
+	for (e = list_begin (&dcache_lru); e != list_end (&dcache_lru); ) {
+		struct dentry *d = list_entry (e, struct dentry, lru_elem);
+
+		e = list_next (e);
+		if (d->parent == parent) {
+			list_remove (&d->lru_elem);
+			hash_delete (&dcache, &d->elem);
+			dentry_cnt--;
+			free (d);
+		}
+	}
+	lock_release (&dcache_lock);
+}
+
+/* Returns the entry for NAME in PARENT, or NULL.  Caller holds
+ * dcache_lock. */
+static struct dentry *
+dcache_find (disk_sector_t parent, const char *name) {
+	struct dentry key;
+	struct hash_elem *e;
+
+	if (strlen (name) > NAME_MAX)
+		return NULL;
+	key.parent = parent;
+	strlcpy (key.name, name, sizeof key.name);
+	e = hash_find (&dcache, &key.elem);
+	return e != NULL ? hash_entry (e, struct dentry, elem) : NULL;
+}
+
+static uint64_t
+dentry_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct dentry *d = hash_entry (e, struct dentry, elem);
+	return hash_string (d->name) ^ hash_int (d->parent);
+}
+
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct dentry *a = hash_entry (a_, struct dentry, elem);
+	const struct dentry *b = hash_entry (b_, struct dentry, elem);
+
+	if (a->parent != b->parent)
+		return a->parent < b->parent;
+	return strcmp (a->name, b->name) < 0;
+}
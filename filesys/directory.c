@@ -1,7 +1,19 @@
+/* directory.c: Directories.
+ *
+ * A directory is an open-addressed hash table of entries.  An entry is
+ * stored within DIR_PROBE_MAX slots of the slot its name hashes to, so
+ * a lookup reads at most that many entries, which lie in one or two
+ * sectors.  A slot that was never used is all zeros.  A removed entry
+ * keeps its inode sector with in_use false, so that lookups probe past
+ * it.  When a new name finds no free slot in its window, the table
+ * doubles and every entry is placed again. */
+
 #include "filesys/directory.h"
+#include <hash.h>
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
@@ -19,6 +31,38 @@ struct dir_entry {
 	bool in_use;                        /* In use or free? */
 };
 
+/* Slots probed for a name, starting at its home slot. */
+#define DIR_PROBE_MAX 8
+
+/* Fewest slots a directory grows to. */
+#define DIR_MIN_SLOTS 16
+
+/* Most sectors a directory grows to.  Growing rewrites the whole table
+ * in one journal operation, which must fit in the journal's room for
+ * an operation. */
+#define DIR_MAX_SECTORS 24
+
+static bool dir_grow (struct dir *dir);
+
+/* Returns the number of slots in DIR. */
+static size_t
+slot_cnt (const struct dir *dir) {
+	return inode_length (dir->inode) / sizeof (struct dir_entry);
+}
+
+/* Returns the slot where a search for NAME starts in a table of CNT
+ * slots. */
+static size_t
+home_slot (const char *name, size_t cnt) {
+	return hash_string (name) % cnt;
+}
+
+/* Returns true if E has never held an entry. */
+static bool
+slot_unused (const struct dir_entry *e) {
+	return !e->in_use && e->inode_sector == 0;
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
  * given SECTOR.  Returns true if successful, false on failure. */
 bool
@@ -27,11 +71,13 @@ dir_create (disk_sector_t sector, size_t entry_cnt) {
 }
 
 /* Opens and returns the directory for the given INODE, of which
- * it takes ownership.  Returns a null pointer on failure. */
+ * it takes ownership.  Returns a null pointer on failure.
+ * Directory contents are metadata, so INODE is journaled. */
 struct dir *
 dir_open (struct inode *inode) {
 	struct dir *dir = calloc (1, sizeof *dir);
 	if (inode != NULL && dir != NULL) {
+		inode_journal (inode);
 		dir->inode = inode;
 		dir->pos = 0;
 		return dir;
@@ -80,13 +126,24 @@ static bool
 lookup (const struct dir *dir, const char *name,
 		struct dir_entry *ep, off_t *ofsp) {
 	struct dir_entry e;
-	size_t ofs;
+	size_t cnt, slot, i;
 
 	ASSERT (dir != NULL);
 	ASSERT (name != NULL);
 
-	for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-			ofs += sizeof e)
+	cnt = slot_cnt (dir);
+	if (cnt == 0)
+		return false;
+
+	/* Probing stops early at a slot never used, since an entry is
+	 * always put in the first free slot of its window. */
+	slot = home_slot (name, cnt);
+	for (i = 0; i < DIR_PROBE_MAX && i < cnt; i++, slot = (slot + 1) % cnt) {
+		off_t ofs = slot * sizeof e;
+
+		if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e
+				|| slot_unused (&e))
+			break;
 		if (e.in_use && !strcmp (name, e.name)) {
 			if (ep != NULL)
 				*ep = e;
@@ -94,23 +151,128 @@ lookup (const struct dir *dir, const char *name,
 				*ofsp = ofs;
 			return true;
 		}
+	}
 	return false;
 }
 
+/* Finds a free slot for NAME in DIR and stores its offset in *OFSP.
+ * Returns false if every slot of NAME's window is in use. */
+static bool
+find_free_slot (const struct dir *dir, const char *name, off_t *ofsp) {
+	struct dir_entry e;
+	size_t cnt, slot, i;
+
+	cnt = slot_cnt (dir);
+	if (cnt == 0)
+		return false;
+
+	slot = home_slot (name, cnt);
+	for (i = 0; i < DIR_PROBE_MAX && i < cnt; i++, slot = (slot + 1) % cnt) {
+		off_t ofs = slot * sizeof e;
+
+		if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+			return false;
+		if (!e.in_use) {
+			*ofsp = ofs;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Puts E in the first free slot of its window in TABLE, which has CNT
+ * slots.  Returns false if there is none. */
+static bool
+place_entry (struct dir_entry *table, size_t cnt, const struct dir_entry *e) {
+	size_t slot = home_slot (e->name, cnt);
+
+	for (size_t i = 0; i < DIR_PROBE_MAX && i < cnt;
+			i++, slot = (slot + 1) % cnt)
+		if (!table[slot].in_use) {
+			table[slot] = *e;
+			return true;
+		}
+	return false;
+}
+
+/* Rebuilds DIR with at least twice as many slots, dropping removed
+ * entries.  Returns true if successful, false on a disk or memory
+ * error or if DIR would outgrow DIR_MAX_SECTORS, in which case DIR is
+ * unchanged. */
+static bool
+dir_grow (struct dir *dir) {
+	static const struct dir_entry zero;
+	size_t old_cnt = slot_cnt (dir);
+	size_t new_cnt, i;
+	struct dir_entry *old = NULL, *new = NULL;
+	bool success = false;
+
+	if (old_cnt > 0) {
+		old = malloc (old_cnt * sizeof *old);
+		if (old == NULL
+				|| inode_read_at (dir->inode, old, old_cnt * sizeof *old, 0)
+				!= (off_t) (old_cnt * sizeof *old))
+			goto done;
+	}
+
+	/* Place every entry in memory, doubling again if some window
+	 * overflows. */
+	for (new_cnt = old_cnt * 2 < DIR_MIN_SLOTS ? DIR_MIN_SLOTS : old_cnt * 2;
+			; new_cnt *= 2) {
+		if (new_cnt * sizeof *new > DIR_MAX_SECTORS * DISK_SECTOR_SIZE)
+			goto done;
+		free (new);
+		new = calloc (new_cnt, sizeof *new);
+		if (new == NULL)
+			goto done;
+		for (i = 0; i < old_cnt; i++)
+			if (old[i].in_use && !place_entry (new, new_cnt, &old[i]))
+				break;
+		if (i == old_cnt)
+			break;
+	}
+
+	/* Extend the directory first, so that running out of disk space
+	 * leaves the old table intact. */
+	if (inode_write_at (dir->inode, &zero, sizeof zero,
+				(new_cnt - 1) * sizeof zero) != sizeof zero)
+		goto done;
+	success = inode_write_at (dir->inode, new, new_cnt * sizeof *new, 0)
+		== (off_t) (new_cnt * sizeof *new);
+
+	/* Log the new table in the caller's operation, with the entries it
+	 * moved. */
+	if (success)
+		inode_flush (dir->inode);
+
+done:
+	free (old);
+	free (new);
+	return success;
+}
+
 /* Searches DIR for a file with the given NAME
  * and returns true if one exists, false otherwise.
  * On success, sets *INODE to an inode for the file, otherwise to
- * a null pointer.  The caller must close *INODE. */
+ * a null pointer.  The caller must close *INODE.
+ * Results, including failures, are kept in the dcache. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
 		struct inode **inode) {
+	disk_sector_t parent, sector;
 	struct dir_entry e;
 
 	ASSERT (dir != NULL);
 	ASSERT (name != NULL);
 
-	if (lookup (dir, name, &e, NULL))
-		*inode = inode_open (e.inode_sector);
+	parent = inode_get_inumber (dir->inode);
+	if (!dcache_lookup (parent, name, &sector)) {
+		sector = lookup (dir, name, &e, NULL) ? e.inode_sector : 0;
+		dcache_insert (parent, name, sector, false);
+	}
+
+	if (sector != 0)
+		*inode = inode_open (sector);
 	else
 		*inode = NULL;
 
@@ -140,23 +302,20 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector) {
 	if (lookup (dir, name, NULL, NULL))
 		goto done;
 
-	/* Set OFS to offset of free slot.
-	 * If there are no free slots, then it will be set to the
-	 * current end-of-file.
-
-	 * inode_read_at() will only return a short read at end of file.
-	 * Otherwise, we'd need to verify that we didn't get a short
-	 * read due to something intermittent such as low memory. */
-	for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-			ofs += sizeof e)
-		if (!e.in_use)
-			break;
+	/* Set OFS to offset of free slot, growing the table if NAME's
+	 * window is full. */
+	while (!find_free_slot (dir, name, &ofs))
+		if (!dir_grow (dir))
+			goto done;
 
 	/* Write slot. */
 	e.in_use = true;
 	strlcpy (e.name, name, sizeof e.name);
 	e.inode_sector = inode_sector;
 	success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+	if (success)
+		dcache_insert (inode_get_inumber (dir->inode), name, inode_sector,
+				true);
 
 done:
 	return success;
@@ -189,7 +348,10 @@ dir_remove (struct dir *dir, const char *name) {
 	if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
 		goto done;
 
-	/* Remove inode. */
+	/* Remove inode, forgetting the name and, if it was a directory,
+	 * the names in it. */
+	dcache_insert (inode_get_inumber (dir->inode), name, 0, true);
+	dcache_purge (e.inode_sector);
 	inode_remove (inode);
 	success = true;
 
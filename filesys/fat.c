@@ -1,6 +1,8 @@
 #include "filesys/fat.h"
+#include <bitmap.h>
 #include "devices/disk.h"
 #include "filesys/filesys.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
 #include <stdio.h>
@@ -19,17 +21,25 @@ struct fat_boot {
 /* FAT FS */
 struct fat_fs {
 	struct fat_boot bs;
-	unsigned int *fat;
-	unsigned int fat_length;
-	disk_sector_t data_start;
-	cluster_t last_clst;
+	unsigned int *fat;              /* Whole FAT, fat_sectors long. */
+	unsigned int fat_length;        /* Entries, including unused entry 0. */
+	disk_sector_t data_start;       /* Sector of cluster 1. */
+	cluster_t last_clst;            /* Last valid cluster. */
+	cluster_t free_hint;            /* Where to look for a free cluster. */
+	unsigned int free_cnt;          /* Number of free clusters. */
+	struct bitmap *dirty;           /* FAT sectors changed since written. */
 	struct lock write_lock;
 };
 
+/* FAT entries in a sector. */
+#define ENTRIES_PER_SECTOR (DISK_SECTOR_SIZE / sizeof (cluster_t))
+
 static struct fat_fs *fat_fs;
 
 void fat_boot_create (void);
 void fat_fs_init (void);
+static void fat_alloc_table (void);
+static void fat_set (cluster_t clst, cluster_t val);
 
 void
 fat_init (void) {
@@ -53,31 +63,21 @@ fat_init (void) {
 
 void
 fat_open (void) {
-	fat_fs->fat = calloc (fat_fs->fat_length, sizeof (cluster_t));
-	if (fat_fs->fat == NULL)
-		PANIC ("FAT load failed");
+	// A freshly formatted FAT is already in memory
+	if (fat_fs->fat != NULL)
+		return;
+	fat_alloc_table ();
 
-	// Load FAT directly from the disk
+	// Load the whole FAT straight into the table, a sector at a time
 	uint8_t *buffer = (uint8_t *) fat_fs->fat;
-	off_t bytes_read = 0;
-	off_t bytes_left = sizeof (fat_fs->fat);
-	const off_t fat_size_in_bytes = fat_fs->fat_length * sizeof (cluster_t);
-	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++) {
-		bytes_left = fat_size_in_bytes - bytes_read;
-		if (bytes_left >= DISK_SECTOR_SIZE) {
-			disk_read (filesys_disk, fat_fs->bs.fat_start + i,
-			           buffer + bytes_read);
-			bytes_read += DISK_SECTOR_SIZE;
-		} else {
-			uint8_t *bounce = malloc (DISK_SECTOR_SIZE);
-			if (bounce == NULL)
-				PANIC ("FAT load failed");
-			disk_read (filesys_disk, fat_fs->bs.fat_start + i, bounce);
-			memcpy (buffer + bytes_read, bounce, bytes_left);
-			bytes_read += bytes_left;
-			free (bounce);
-		}
-	}
+	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++)
+		disk_read (filesys_disk, fat_fs->bs.fat_start + i,
+		           buffer + i * DISK_SECTOR_SIZE);
+
+	// Count free clusters once; the count is kept up to date after
+	for (cluster_t clst = 1; clst <= fat_fs->last_clst; clst++)
+		if (fat_fs->fat[clst] == 0)
+			fat_fs->free_cnt++;
 }
 
 void
@@ -90,27 +90,24 @@ fat_close (void) {
 	disk_write (filesys_disk, FAT_BOOT_SECTOR, bounce);
 	free (bounce);
 
-	// Write FAT directly to the disk
+	// The FAT sectors that changed are written by the journal's commit
+	journal_sync ();
+}
+
+/* Writes the FAT sectors that changed through the journal. */
+void
+fat_sync (void) {
 	uint8_t *buffer = (uint8_t *) fat_fs->fat;
-	off_t bytes_wrote = 0;
-	off_t bytes_left = sizeof (fat_fs->fat);
-	const off_t fat_size_in_bytes = fat_fs->fat_length * sizeof (cluster_t);
-	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++) {
-		bytes_left = fat_size_in_bytes - bytes_wrote;
-		if (bytes_left >= DISK_SECTOR_SIZE) {
-			disk_write (filesys_disk, fat_fs->bs.fat_start + i,
-			            buffer + bytes_wrote);
-			bytes_wrote += DISK_SECTOR_SIZE;
-		} else {
-			bounce = calloc (1, DISK_SECTOR_SIZE);
-			if (bounce == NULL)
-				PANIC ("FAT close failed");
-			memcpy (bounce, buffer + bytes_wrote, bytes_left);
-			disk_write (filesys_disk, fat_fs->bs.fat_start + i, bounce);
-			bytes_wrote += bytes_left;
-			free (bounce);
-		}
-	}
+
+	journal_begin ();
+	lock_acquire (&fat_fs->write_lock);
+	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++)
+		if (bitmap_test (fat_fs->dirty, i))
+			journal_write (fat_fs->bs.fat_start + i,
+			               buffer + i * DISK_SECTOR_SIZE, 0, DISK_SECTOR_SIZE);
+	bitmap_set_all (fat_fs->dirty, false);
+	lock_release (&fat_fs->write_lock);
+	journal_end ();
 }
 
 void
@@ -119,10 +116,13 @@ fat_create (void) {
 	fat_boot_create ();
 	fat_fs_init ();
 
-	// Create FAT table
-	fat_fs->fat = calloc (fat_fs->fat_length, sizeof (cluster_t));
-	if (fat_fs->fat == NULL)
-		PANIC ("FAT creation failed");
+	// Create FAT table, every sector of which must be written
+	free (fat_fs->fat);
+	if (fat_fs->dirty != NULL)
+		bitmap_destroy (fat_fs->dirty);
+	fat_alloc_table ();
+	bitmap_set_all (fat_fs->dirty, true);
+	fat_fs->free_cnt = fat_fs->last_clst;
 
 	// Set up ROOT_DIR_CLST
 	fat_put (ROOT_DIR_CLUSTER, EOChain);
@@ -137,13 +137,15 @@ fat_create (void) {
 
 void
 fat_boot_create (void) {
+	// The journal takes the end of the disk
+	disk_sector_t total_sectors = disk_size (filesys_disk) - JOURNAL_SECTORS;
 	unsigned int fat_sectors =
-	    (disk_size (filesys_disk) - 1)
+	    (total_sectors - 1)
 	    / (DISK_SECTOR_SIZE / sizeof (cluster_t) * SECTORS_PER_CLUSTER + 1) + 1;
 	fat_fs->bs = (struct fat_boot){
 	    .magic = FAT_MAGIC,
 	    .sectors_per_cluster = SECTORS_PER_CLUSTER,
-	    .total_sectors = disk_size (filesys_disk),
+	    .total_sectors = total_sectors,
 	    .fat_start = 1,
 	    .fat_sectors = fat_sectors,
 	    .root_dir_cluster = ROOT_DIR_CLUSTER,
@@ -152,7 +154,26 @@ fat_boot_create (void) {
 
 void
 fat_fs_init (void) {
-	/* TODO: Your code goes here. */
+	fat_fs->data_start = fat_fs->bs.fat_start + fat_fs->bs.fat_sectors;
+
+	/* Entry 0 is not a cluster, so clusters are numbered from 1. */
+	fat_fs->fat_length = (fat_fs->bs.total_sectors - fat_fs->data_start)
+		/ SECTORS_PER_CLUSTER + 1;
+	if (fat_fs->fat_length > fat_fs->bs.fat_sectors * ENTRIES_PER_SECTOR)
+		fat_fs->fat_length = fat_fs->bs.fat_sectors * ENTRIES_PER_SECTOR;
+	fat_fs->last_clst = fat_fs->fat_length - 1;
+	fat_fs->free_hint = 1;
+	lock_init (&fat_fs->write_lock);
+}
+
+/* Allocates a zeroed in-memory FAT, whole sectors long so that each
+ * sector can be transferred in place, and its dirty-sector map. */
+static void
+fat_alloc_table (void) {
+	fat_fs->fat = calloc (fat_fs->bs.fat_sectors, DISK_SECTOR_SIZE);
+	fat_fs->dirty = bitmap_create (fat_fs->bs.fat_sectors);
+	if (fat_fs->fat == NULL || fat_fs->dirty == NULL)
+		PANIC ("FAT allocation failed");
 }
 
 /*----------------------------------------------------------------------------*/
@@ -164,30 +185,86 @@ fat_fs_init (void) {
  * Returns 0 if fails to allocate a new cluster. */
 cluster_t
 fat_create_chain (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	cluster_t new_clst = 0;
+
+	ASSERT (clst <= fat_fs->last_clst);
+
+	lock_acquire (&fat_fs->write_lock);
+	if (fat_fs->free_cnt > 0) {
+		/* Next fit: a free cluster is found where the last one was. */
+		new_clst = fat_fs->free_hint;
+		while (fat_fs->fat[new_clst] != 0)
+			new_clst = new_clst < fat_fs->last_clst ? new_clst + 1 : 1;
+		fat_fs->free_hint = new_clst < fat_fs->last_clst ? new_clst + 1 : 1;
+
+		fat_set (new_clst, EOChain);
+		if (clst != 0)
+			fat_set (clst, new_clst);
+	}
+	lock_release (&fat_fs->write_lock);
+	return new_clst;
 }
 
 /* Remove the chain of clusters starting from CLST.
  * If PCLST is 0, assume CLST as the start of the chain. */
 void
 fat_remove_chain (cluster_t clst, cluster_t pclst) {
-	/* TODO: Your code goes here. */
+	lock_acquire (&fat_fs->write_lock);
+	if (pclst != 0)
+		fat_set (pclst, EOChain);
+	while (clst != 0 && clst != EOChain) {
+		cluster_t next = fat_fs->fat[clst];
+		fat_set (clst, 0);
+		clst = next;
+	}
+	lock_release (&fat_fs->write_lock);
+}
+
+/* Returns the number of free clusters. */
+size_t
+fat_free_count (void) {
+	return fat_fs->free_cnt;
 }
 
 /* Update a value in the FAT table. */
 void
 fat_put (cluster_t clst, cluster_t val) {
-	/* TODO: Your code goes here. */
+	lock_acquire (&fat_fs->write_lock);
+	fat_set (clst, val);
+	lock_release (&fat_fs->write_lock);
 }
 
 /* Fetch a value in the FAT table. */
 cluster_t
 fat_get (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	ASSERT (clst >= 1 && clst <= fat_fs->last_clst);
+	return fat_fs->fat[clst];
+}
+
+/* Stores VAL in the entry of CLST, keeping the free count and the
+ * dirty-sector map up to date.  Caller holds write_lock. */
+static void
+fat_set (cluster_t clst, cluster_t val) {
+	ASSERT (clst >= 1 && clst <= fat_fs->last_clst);
+
+	if (fat_fs->fat[clst] == 0 && val != 0)
+		fat_fs->free_cnt--;
+	else if (fat_fs->fat[clst] != 0 && val == 0)
+		fat_fs->free_cnt++;
+	fat_fs->fat[clst] = val;
+	bitmap_mark (fat_fs->dirty, clst / ENTRIES_PER_SECTOR);
 }
 
 /* Covert a cluster # to a sector number. */
 disk_sector_t
 cluster_to_sector (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	ASSERT (clst >= 1 && clst <= fat_fs->last_clst);
+	return fat_fs->data_start + (clst - 1) * SECTORS_PER_CLUSTER;
+}
+
+/* Convert a sector number to the cluster # holding it. */
+cluster_t
+sector_to_cluster (disk_sector_t sector) {
+	ASSERT (sector >= fat_fs->data_start);
+	return (sector - fat_fs->data_start) / SECTORS_PER_CLUSTER + 1;
 }
@@ -2,10 +2,13 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
+#include "filesys/page_cache.h"
 #include "devices/disk.h"
 
 /* The disk that contains the file system. */
@@ -21,10 +24,14 @@ filesys_init (bool format) {
 	if (filesys_disk == NULL)
 		PANIC ("hd0:1 (hdb) not present, file system initialization failed");
 
+	journal_init ();
 	inode_init ();
+	dcache_init ();
+	page_cache_init ();
 
 #ifdef EFILESYS
 	fat_init ();
+	free_map_init ();
 
 	if (format)
 		do_format ();
@@ -45,12 +52,23 @@ filesys_init (bool format) {
  * to disk. */
 void
 filesys_done (void) {
+	inode_flush_all ();
+
 	/* Original FS */
 #ifdef EFILESYS
 	fat_close ();
 #else
 	free_map_close ();
 #endif
+	journal_sync ();
+}
+
+/* Writes metadata kept in memory to the journal and commits it, which
+ * writes every dirty cached sector back to disk as well. */
+void
+filesys_sync (void) {
+	inode_flush_all ();
+	journal_sync ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -60,14 +78,17 @@ filesys_done (void) {
 bool
 filesys_create (const char *name, off_t initial_size) {
 	disk_sector_t inode_sector = 0;
+	journal_begin ();
 	struct dir *dir = dir_open_root ();
 	bool success = (dir != NULL
-			&& free_map_allocate (1, &inode_sector)
+			&& free_map_allocate_near (1,
+				inode_get_inumber (dir_get_inode (dir)), &inode_sector)
 			&& inode_create (inode_sector, initial_size)
 			&& dir_add (dir, name, inode_sector));
 	if (!success && inode_sector != 0)
 		free_map_release (inode_sector, 1);
 	dir_close (dir);
+	journal_end ();
 
 	return success;
 }
@@ -95,9 +116,11 @@ filesys_open (const char *name) {
  * or if an internal memory allocation fails. */
 bool
 filesys_remove (const char *name) {
+	journal_begin ();
 	struct dir *dir = dir_open_root ();
 	bool success = dir != NULL && dir_remove (dir, name);
 	dir_close (dir);
+	journal_end ();
 
 	return success;
 }
@@ -110,6 +133,8 @@ do_format (void) {
 #ifdef EFILESYS
 	/* Create FAT and save it to the disk. */
 	fat_create ();
+	if (!dir_create (ROOT_DIR_SECTOR, 16))
+		PANIC ("root directory creation failed");
 	fat_close ();
 #else
 	free_map_create ();
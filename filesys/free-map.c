@@ -1,21 +1,109 @@
+/* free-map.c: Free sector bitmap.
+ *
+ * The bitmap is what is kept on disk.  Allocation works on an
+ * in-memory index of the free extents, the runs of free sectors, kept
+ * both in an array sorted by start sector, searched by bisection, and
+ * in lists by size class.  A request with a goal sector takes the
+ * first fitting extent at or after the goal, so a file's sectors
+ * follow its inode and each other; one without a goal, or whose goal
+ * is followed by NEAR_SCAN_MAX extents too small for it, takes the
+ * smallest fitting extent.  Changes to the bitmap are written to the
+ * free map file only by free_map_sync(), which only the journal's
+ * commit calls, so that they go through the log; only the sectors of
+ * the file that changed are written.
+ *
+ * Sectors may also be reserved, for data whose sectors are chosen
+ * later (see inode.c).  Reserved sectors stay free, but only the rest
+ * are handed out, so the reservation can always be honored.
+ *
+ * With EFILESYS the FAT keeps track of free space instead, and
+ * free_map_allocate() and free_map_release() hand out and take back
+ * one-cluster chains. */
+
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <string.h>
+#ifdef EFILESYS
+#include "filesys/fat.h"
+#endif
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Size classes of free extents.  Class N holds extents of 2**N to
+ * 2**(N+1) - 1 sectors; the last class holds all longer ones. */
+#define EXTENT_CLASSES 12
+
+/* Extents after a goal sector looked at before falling back to the
+ * best fit anywhere. */
+#define NEAR_SCAN_MAX 32
+
+/* Bits of the free map held by one sector of its file. */
+#define BITS_PER_SECTOR (DISK_SECTOR_SIZE * 8)
+
+/* A run of free sectors. */
+struct free_extent {
+	struct list_elem class_elem;        /* Element in size_classes[]. */
+	disk_sector_t start;                /* First sector. */
+	size_t cnt;                         /* Number of sectors. */
+};
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per disk sector. */
+static struct bitmap *dirty_sectors; /* Sectors of free_map_file changed
+                                        since last written. */
+static size_t reserved_cnt;          /* Free sectors reserved. */
+
+#ifndef EFILESYS
+static size_t free_cnt;              /* Number of free sectors. */
+static struct free_extent **extents; /* Free extents by start sector. */
+static size_t extent_cnt;            /* Number of extents. */
+static size_t extent_cap;            /* Slots allocated in extents. */
+static struct list size_classes[EXTENT_CLASSES];
+#endif
+
+/* Protects all of the above. */
+static struct lock free_map_lock;
+
+#ifndef EFILESYS
+static void mark_dirty (disk_sector_t start, size_t cnt);
+static void build_extents (void);
+static size_t extent_index (disk_sector_t sector);
+static struct free_extent *extent_new (disk_sector_t start, size_t cnt,
+		size_t idx);
+static void extent_delete (size_t idx);
+static void extent_insert (disk_sector_t start, size_t cnt);
+static void extent_take (struct free_extent *ext, disk_sector_t start,
+		size_t cnt);
+static struct free_extent *find_near (size_t cnt, disk_sector_t goal,
+		disk_sector_t *startp);
+static struct free_extent *find_best (size_t cnt);
+#endif
+static size_t available (void);
 
 /* Initializes the free map. */
 void
 free_map_init (void) {
+	lock_init (&free_map_lock);
+#ifndef EFILESYS
+	for (int i = 0; i < EXTENT_CLASSES; i++)
+		list_init (&size_classes[i]);
 	free_map = bitmap_create (disk_size (filesys_disk));
-	if (free_map == NULL)
+	dirty_sectors = bitmap_create (DIV_ROUND_UP (disk_size (filesys_disk),
+				BITS_PER_SECTOR));
+	if (free_map == NULL || dirty_sectors == NULL)
 		PANIC ("bitmap creation failed--disk is too large");
 	bitmap_mark (free_map, FREE_MAP_SECTOR);
 	bitmap_mark (free_map, ROOT_DIR_SECTOR);
+	bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+	build_extents ();
+#endif
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
@@ -24,24 +112,113 @@ free_map_init (void) {
  * available. */
 bool
 free_map_allocate (size_t cnt, disk_sector_t *sectorp) {
-	disk_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-	if (sector != BITMAP_ERROR
-			&& free_map_file != NULL
-			&& !bitmap_write (free_map, free_map_file)) {
-		bitmap_set_multiple (free_map, sector, cnt, false);
-		sector = BITMAP_ERROR;
+	return free_map_allocate_near (cnt, 0, sectorp);
+}
+
+/* Like free_map_allocate(), but places the sectors at or after GOAL
+ * if there is room there, or as close after it as possible.  A GOAL of
+ * 0 asks for the best fit anywhere instead. */
+bool
+free_map_allocate_near (size_t cnt, disk_sector_t goal UNUSED,
+		disk_sector_t *sectorp) {
+#ifdef EFILESYS
+	/* Clusters are handed out one at a time. */
+	cluster_t clst = 0;
+
+	lock_acquire (&free_map_lock);
+	if (cnt == 1 && available () >= cnt)
+		clst = fat_create_chain (0);
+	lock_release (&free_map_lock);
+	if (clst == 0)
+		return false;
+	*sectorp = cluster_to_sector (clst);
+	return true;
+#else
+	struct free_extent *ext = NULL;
+	disk_sector_t start;
+
+	lock_acquire (&free_map_lock);
+	if (available () >= cnt) {
+		if (goal != 0)
+			ext = find_near (cnt, goal, &start);
+		else if ((ext = find_best (cnt)) != NULL)
+			start = ext->start;
 	}
-	if (sector != BITMAP_ERROR)
-		*sectorp = sector;
-	return sector != BITMAP_ERROR;
+	if (ext != NULL) {
+		extent_take (ext, start, cnt);
+		bitmap_set_multiple (free_map, start, cnt, true);
+		mark_dirty (start, cnt);
+		free_cnt -= cnt;
+		*sectorp = start;
+	}
+	lock_release (&free_map_lock);
+	return ext != NULL;
+#endif
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (disk_sector_t sector, size_t cnt) {
+#ifdef EFILESYS
+	for (size_t i = 0; i < cnt; i++)
+		fat_remove_chain (sector_to_cluster (sector + i), 0);
+#else
+	lock_acquire (&free_map_lock);
 	ASSERT (bitmap_all (free_map, sector, cnt));
 	bitmap_set_multiple (free_map, sector, cnt, false);
-	bitmap_write (free_map, free_map_file);
+	extent_insert (sector, cnt);
+	mark_dirty (sector, cnt);
+	free_cnt += cnt;
+	lock_release (&free_map_lock);
+#endif
+}
+
+/* Reserves CNT free sectors, which free_map_allocate() will then only
+ * hand out to callers that first give the reservation back.  Returns
+ * false, reserving nothing, if fewer than CNT are available. */
+bool
+free_map_reserve (size_t cnt) {
+	bool success;
+
+	lock_acquire (&free_map_lock);
+	success = available () >= cnt;
+	if (success)
+		reserved_cnt += cnt;
+	lock_release (&free_map_lock);
+	return success;
+}
+
+/* Gives back CNT sectors reserved by free_map_reserve(). */
+void
+free_map_unreserve (size_t cnt) {
+	lock_acquire (&free_map_lock);
+	ASSERT (reserved_cnt >= cnt);
+	reserved_cnt -= cnt;
+	lock_release (&free_map_lock);
+}
+
+/* Writes the sectors of the free map file that changed since they
+ * were last written. */
+void
+free_map_sync (void) {
+	size_t sector_idx = 0;
+
+	journal_begin ();
+	lock_acquire (&free_map_lock);
+	while (free_map_file != NULL && dirty_sectors != NULL
+			&& (sector_idx = bitmap_scan (dirty_sectors, sector_idx, 1, true))
+				!= BITMAP_ERROR) {
+		size_t start = sector_idx * BITS_PER_SECTOR;
+		size_t cnt = bitmap_size (free_map) - start;
+
+		if (cnt > BITS_PER_SECTOR)
+			cnt = BITS_PER_SECTOR;
+		if (bitmap_write_range (free_map, free_map_file, start, cnt))
+			bitmap_reset (dirty_sectors, sector_idx);
+		sector_idx++;
+	}
+	lock_release (&free_map_lock);
+	journal_end ();
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -50,14 +227,21 @@ free_map_open (void) {
 	free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
 	if (free_map_file == NULL)
 		PANIC ("can't open free map");
+	inode_journal (file_get_inode (free_map_file));
 	if (!bitmap_read (free_map, free_map_file))
 		PANIC ("can't read free map");
+#ifndef EFILESYS
+	build_extents ();
+#endif
 }
 
-/* Writes the free map to disk and closes the free map file. */
+/* Writes the free map to disk and closes the free map file.  Only a
+ * commit writes the free map, so that it goes through the log. */
 void
 free_map_close (void) {
+	journal_sync ();
 	file_close (free_map_file);
+	free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -72,6 +256,235 @@ free_map_create (void) {
 	free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
 	if (free_map_file == NULL)
 		PANIC ("can't open free map");
+	inode_journal (file_get_inode (free_map_file));
 	if (!bitmap_write (free_map, free_map_file))
 		PANIC ("can't write free map");
+
+	/* Give the file its sectors now, so that free_map_sync(), which
+	 * holds free_map_lock, never has to allocate any.  The file was
+	 * written before those sectors were taken, so the next commit
+	 * writes all of it again. */
+	inode_flush (file_get_inode (free_map_file));
+	bitmap_set_all (dirty_sectors, true);
+}
+
+/* Returns the number of free sectors not reserved.  Caller holds
+ * free_map_lock. */
+static size_t
+available (void) {
+#ifdef EFILESYS
+	size_t free_sectors = fat_free_count ();
+#else
+	size_t free_sectors = free_cnt;
+#endif
+	return free_sectors > reserved_cnt ? free_sectors - reserved_cnt : 0;
+}
+
+#ifndef EFILESYS
+/* Notes that the CNT bits of the free map from START changed.  Caller
+ * holds free_map_lock. */
+static void
+mark_dirty (disk_sector_t start, size_t cnt) {
+	size_t first = start / BITS_PER_SECTOR;
+	size_t last = (start + cnt - 1) / BITS_PER_SECTOR;
+
+	bitmap_set_multiple (dirty_sectors, first, last - first + 1, true);
+}
+
+/* Returns the size class of an extent of CNT sectors. */
+static int
+size_class (size_t cnt) {
+	int class = 0;
+
+	while (cnt >>= 1)
+		class++;
+	return class < EXTENT_CLASSES ? class : EXTENT_CLASSES - 1;
+}
+
+/* Adds EXT to the list of its size class. */
+static void
+class_insert (struct free_extent *ext) {
+	list_push_back (&size_classes[size_class (ext->cnt)], &ext->class_elem);
+}
+
+/* Rebuilds the extents from the bitmap. */
+static void
+build_extents (void) {
+	size_t sector_cnt = bitmap_size (free_map);
+	size_t start, end;
+
+	while (extent_cnt > 0)
+		free (extents[--extent_cnt]);
+	for (int i = 0; i < EXTENT_CLASSES; i++)
+		list_init (&size_classes[i]);
+	free_cnt = bitmap_count (free_map, 0, sector_cnt, false);
+
+	for (start = bitmap_scan (free_map, 0, 1, false);
+			start != BITMAP_ERROR;
+			start = bitmap_scan (free_map, end, 1, false)) {
+		for (end = start; end < sector_cnt && !bitmap_test (free_map, end);
+				end++)
+			continue;
+		extent_new (start, end - start, extent_cnt);
+		if (end == sector_cnt)
+			break;
+	}
+}
+
+/* Returns the number of extents that start at or before SECTOR, which
+ * is the index of the first one that starts after it. */
+static size_t
+extent_index (disk_sector_t sector) {
+	size_t lo = 0, hi = extent_cnt;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (extents[mid]->start <= sector)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Records CNT sectors from START as free, merging them with the
+ * extents they touch. */
+static void
+extent_insert (disk_sector_t start, size_t cnt) {
+	size_t idx = extent_index (start);
+	struct free_extent *prev = idx > 0 ? extents[idx - 1] : NULL;
+	struct free_extent *next = idx < extent_cnt ? extents[idx] : NULL;
+
+	if (prev != NULL && prev->start + prev->cnt == start) {
+		list_remove (&prev->class_elem);
+		prev->cnt += cnt;
+		if (next != NULL && start + cnt == next->start) {
+			prev->cnt += next->cnt;
+			extent_delete (idx);
+		}
+		class_insert (prev);
+	} else if (next != NULL && start + cnt == next->start) {
+		list_remove (&next->class_elem);
+		next->start = start;
+		next->cnt += cnt;
+		class_insert (next);
+	} else
+		extent_new (start, cnt, idx);
+}
+
+/* Adds a free extent of CNT sectors from START at index IDX of
+ * extents, and returns it. */
+static struct free_extent *
+extent_new (disk_sector_t start, size_t cnt, size_t idx) {
+	struct free_extent *ext = malloc (sizeof *ext);
+
+	if (ext == NULL)
+		PANIC ("free extent allocation failed");
+	if (extent_cnt == extent_cap) {
+		size_t cap = extent_cap != 0 ? extent_cap * 2 : 64;
+		struct free_extent **grown = realloc (extents, cap * sizeof *grown);
+		if (grown == NULL)
+			PANIC ("free extent allocation failed");
+		extents = grown;
+		extent_cap = cap;
+	}
+	memmove (&extents[idx + 1], &extents[idx],
+			(extent_cnt - idx) * sizeof *extents);
+	extents[idx] = ext;
+	extent_cnt++;
+	ext->start = start;
+	ext->cnt = cnt;
+	class_insert (ext);
+	return ext;
+}
+
+/* Removes the extent at index IDX of extents and frees it. */
+static void
+extent_delete (size_t idx) {
+	struct free_extent *ext = extents[idx];
+
+	list_remove (&ext->class_elem);
+	memmove (&extents[idx], &extents[idx + 1],
+			(extent_cnt - idx - 1) * sizeof *extents);
+	extent_cnt--;
+	free (ext);
+}
+
+/* Removes the CNT sectors from START, which lie within EXT, from the
+ * free extents. */
+static void
+extent_take (struct free_extent *ext, disk_sector_t start, size_t cnt) {
+	disk_sector_t end = ext->start + ext->cnt;
+
+	size_t idx = extent_index (ext->start) - 1;
+
+	ASSERT (start >= ext->start && start + cnt <= end);
+	ASSERT (extents[idx] == ext);
+
+	if (start == ext->start && cnt == ext->cnt) {
+		extent_delete (idx);
+		return;
+	}
+
+	list_remove (&ext->class_elem);
+	if (start + cnt < end && start > ext->start) {
+		/* Split in two; the tail gets a new extent. */
+		extent_new (start + cnt, end - (start + cnt), idx + 1);
+		ext->cnt = start - ext->start;
+	} else if (start > ext->start) {
+		ext->cnt = start - ext->start;
+	} else {
+		ext->start += cnt;
+		ext->cnt -= cnt;
+	}
+	class_insert (ext);
+}
+
+/* Returns the extent holding the first CNT free sectors at or after
+ * GOAL, looking at no more than NEAR_SCAN_MAX extents past it before
+ * settling for the best fit anywhere, and stores where they begin in
+ * *STARTP.  Returns NULL if there is no room. */
+static struct free_extent *
+find_near (size_t cnt, disk_sector_t goal, disk_sector_t *startp) {
+	size_t idx = extent_index (goal);
+	struct free_extent *ext;
+
+	if (idx > 0) {
+		ext = extents[idx - 1];
+		if (ext->start + ext->cnt > goal && ext->start + ext->cnt - goal >= cnt) {
+			*startp = goal;
+			return ext;
+		}
+	}
+	for (size_t i = idx; i < extent_cnt && i - idx < NEAR_SCAN_MAX; i++)
+		if (extents[i]->cnt >= cnt) {
+			*startp = extents[i]->start;
+			return extents[i];
+		}
+
+	ext = find_best (cnt);
+	if (ext != NULL)
+		*startp = ext->start;
+	return ext;
+}
+
+/* Returns the smallest extent of at least CNT sectors, or NULL. */
+static struct free_extent *
+find_best (size_t cnt) {
+	for (int class = size_class (cnt); class < EXTENT_CLASSES; class++) {
+		struct free_extent *best = NULL;
+		struct list_elem *e;
+
+		for (e = list_begin (&size_classes[class]);
+				e != list_end (&size_classes[class]); e = list_next (e)) {
+			struct free_extent *ext = list_entry (e, struct free_extent,
+					class_elem);
+			if (ext->cnt >= cnt && (best == NULL || ext->cnt < best->cnt))
+				best = ext;
+		}
+		if (best != NULL)
+			return best;
+	}
+	return NULL;
 }
+#endif
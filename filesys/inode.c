@@ -1,22 +1,54 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
+#include "filesys/page_cache.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#ifdef VM
+#include "vm/share.h"
+#endif
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Closed inodes kept in memory in case they are opened again. */
+#define INODE_CACHE_SIZE 32
+
+/* Delayed blocks an inode may hold before it is flushed. */
+#define DELAYED_MAX 64
+
+/* Sector numbers held in an indirect block. */
+#define PTRS_PER_SECTOR (DISK_SECTOR_SIZE / sizeof (disk_sector_t))
+
+/* Data sectors mapped directly by the inode, and levels of indirect
+ * blocks after them: singly, doubly and triply indirect. */
+#define DIRECT_CNT 123
+#define INDIRECT_LEVELS 3
+
+/* Longest file an inode can map. */
+#define MAX_LENGTH ((off_t) (DIRECT_CNT + PTRS_PER_SECTOR \
+			+ PTRS_PER_SECTOR * PTRS_PER_SECTOR \
+			+ PTRS_PER_SECTOR * PTRS_PER_SECTOR * PTRS_PER_SECTOR) \
+		* DISK_SECTOR_SIZE)
+
 /* On-disk inode.
- * Must be exactly DISK_SECTOR_SIZE bytes long. */
+ * Must be exactly DISK_SECTOR_SIZE bytes long.
+ * A sector number of 0 means no sector is allocated; sector 0 always
+ * belongs to the file system itself.  Files are sparse: a block with no
+ * sector reads as zeros, and only gets one once it is written. */
 struct inode_disk {
-	disk_sector_t start;                /* First data sector. */
 	off_t length;                       /* File size in bytes. */
 	unsigned magic;                     /* Magic number. */
-	uint32_t unused[125];               /* Not used. */
+	disk_sector_t direct[DIRECT_CNT];   /* First data sectors. */
+	disk_sector_t indirect[INDIRECT_LEVELS]; /* Roots of indirect blocks. */
 };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -28,42 +60,336 @@ bytes_to_sectors (off_t size) {
 
 /* In-memory inode. */
 struct inode {
-	struct list_elem elem;              /* Element in inode list. */
+	struct hash_elem elem;              /* Element in open_inodes. */
+	struct list_elem lru_elem;          /* Element in closed_inodes. */
 	disk_sector_t sector;               /* Sector number of disk location. */
 	int open_cnt;                       /* Number of openers. */
 	bool removed;                       /* True if deleted, false otherwise. */
 	int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+	bool journaled;                     /* Data is metadata too? */
+	struct lock lock;                   /* Protects the members below. */
 	struct inode_disk data;             /* Inode content. */
+	bool dirty;                         /* DATA changed since written? */
+	struct hash delayed;                /* Delayed blocks, by index. */
+	struct list delayed_list;           /* Delayed blocks, oldest first. */
+	size_t delayed_cnt;                 /* Number of delayed blocks. */
+	size_t reserved;                    /* Sectors reserved for them. */
 };
 
+/* A block of data written where the file has no sector.  Its sector is
+ * only chosen when the inode is flushed; until then, sectors are
+ * reserved in the free map so that the flush cannot run out of space. */
+struct delayed_block {
+	struct hash_elem hash_elem;         /* Element in inode's delayed. */
+	struct list_elem list_elem;         /* Element in delayed_list. */
+	size_t idx;                         /* Index of the block in the file. */
+	uint8_t data[DISK_SECTOR_SIZE];     /* Contents. */
+};
+
+/* Writes SIZE bytes from BUFFER to offset OFS of SECTOR, a data
+ * sector of INODE, through the journal if INODE is journaled. */
+static void
+data_write (struct inode *inode, disk_sector_t sector, const void *buffer,
+		off_t ofs, size_t size) {
+	if (inode->journaled)
+		journal_write (sector, buffer, ofs, size);
+	else
+		page_cache_write (sector, buffer, ofs, size);
+}
+
+/* Returns the sector in *SLOT.  If there is none, stores LEAF there if
+ * it is nonzero; otherwise, if GOAL is nonnull, allocates a zeroed
+ * sector as near after *GOAL as possible, stores it there, and
+ * advances *GOAL past it.  Returns 0 if there is no sector or the disk
+ * is full. */
+static disk_sector_t
+get_slot (disk_sector_t *slot, disk_sector_t *goal, disk_sector_t leaf) {
+	static char zeros[DISK_SECTOR_SIZE];
+
+	if (*slot != 0)
+		return *slot;
+	if (leaf != 0)
+		*slot = leaf;
+	else if (goal != NULL && free_map_allocate_near (1, *goal, slot)) {
+		journal_write (*slot, zeros, 0, DISK_SECTOR_SIZE);
+		*goal = *slot + 1;
+	}
+	return *slot;
+}
+
+/* Like get_slot(), for entry IDX of indirect block TABLE. */
+static disk_sector_t
+get_entry (disk_sector_t table, size_t idx, disk_sector_t *goal,
+		disk_sector_t leaf) {
+	const off_t ofs = idx * sizeof (disk_sector_t);
+	disk_sector_t sector;
+
+	page_cache_read (table, &sector, ofs, sizeof sector);
+	if (sector == 0 && get_slot (&sector, goal, leaf) != 0)
+		journal_write (table, &sector, ofs, sizeof sector);
+	return sector;
+}
+
+/* Returns the sector holding data sector IDX of DISK_INODE.  If GOAL
+ * is nonnull, allocates the indirect blocks leading to it as
+ * get_slot() does, and then the data sector too, unless LEAF is
+ * nonzero, in which case LEAF becomes the data sector.  Returns 0 if
+ * there is no such sector, or if it cannot be allocated. */
+static disk_sector_t
+index_to_sector (struct inode_disk *disk_inode, size_t idx,
+		disk_sector_t *goal, disk_sector_t leaf) {
+	size_t span = PTRS_PER_SECTOR;      /* Data sectors below one root. */
+
+	if (idx < DIRECT_CNT)
+		return get_slot (&disk_inode->direct[idx], goal, leaf);
+	idx -= DIRECT_CNT;
+
+	for (int level = 0; level < INDIRECT_LEVELS; level++) {
+		if (idx < span) {
+			disk_sector_t sector = get_slot (&disk_inode->indirect[level],
+					goal, 0);
+			while (sector != 0 && span > 1) {
+				span /= PTRS_PER_SECTOR;
+				sector = get_entry (sector, idx / span, goal,
+						span == 1 ? leaf : 0);
+				idx %= span;
+			}
+			return sector;
+		}
+		idx -= span;
+		span *= PTRS_PER_SECTOR;
+	}
+	return 0;
+}
+
 /* Returns the disk sector that contains byte offset POS within
  * INODE.
  * Returns -1 if INODE does not contain data for a byte at offset
  * POS. */
 static disk_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) {
+byte_to_sector (struct inode *inode, off_t pos) {
 	ASSERT (inode != NULL);
 	if (pos < inode->data.length)
-		return inode->data.start + pos / DISK_SECTOR_SIZE;
+		return index_to_sector (&inode->data, pos / DISK_SECTOR_SIZE, NULL, 0);
 	else
 		return -1;
 }
 
+/* Releases SECTOR, an indirect block DEPTH levels above the data if
+ * DEPTH is positive, and every sector it points to. */
+static void
+free_tree (disk_sector_t sector, int depth) {
+	for (size_t i = 0; depth > 0 && i < PTRS_PER_SECTOR; i++) {
+		disk_sector_t entry;
+
+		page_cache_read (sector, &entry, i * sizeof entry, sizeof entry);
+		if (entry != 0)
+			free_tree (entry, depth - 1);
+	}
+	free_map_release (sector, 1);
+}
+
+/* Releases every sector DISK_INODE maps, including indirect blocks. */
+static void
+free_blocks (struct inode_disk *disk_inode) {
+	for (size_t i = 0; i < DIRECT_CNT; i++)
+		if (disk_inode->direct[i] != 0)
+			free_map_release (disk_inode->direct[i], 1);
+	for (int level = 0; level < INDIRECT_LEVELS; level++)
+		if (disk_inode->indirect[level] != 0)
+			free_tree (disk_inode->indirect[level], level + 1);
+}
+
+/* Sectors to reserve for CNT delayed blocks: the blocks themselves and
+ * the indirect blocks a run of them may need. */
+static size_t
+reservation (size_t cnt) {
+	if (cnt == 0)
+		return 0;
+	return cnt + DIV_ROUND_UP (cnt, PTRS_PER_SECTOR) + INDIRECT_LEVELS;
+}
+
+/* Returns the most sectors that giving block IDX of INODE a sector
+ * may log: each indirect block leading to it, zeroed and then pointed
+ * to, the block itself if it is metadata, and the inode. */
+static size_t
+flush_cost (const struct inode *inode, size_t idx) {
+	size_t levels = 0, span = PTRS_PER_SECTOR;
+
+	if (idx >= DIRECT_CNT)
+		for (idx -= DIRECT_CNT, levels = 1; idx >= span; levels++) {
+			idx -= span;
+			span *= PTRS_PER_SECTOR;
+		}
+	return 2 * levels + (inode->journaled ? 1 : 0) + 1;
+}
+
+/* Returns INODE's delayed block with index IDX, or NULL.  Caller holds
+ * INODE's lock. */
+static struct delayed_block *
+delayed_find (struct inode *inode, size_t idx) {
+	struct delayed_block key;
+	struct hash_elem *e;
+
+	key.idx = idx;
+	e = hash_find (&inode->delayed, &key.hash_elem);
+	return e != NULL ? hash_entry (e, struct delayed_block, hash_elem) : NULL;
+}
+
+/* Returns INODE's delayed block with index IDX, creating it zeroed if
+ * there is none.  Returns NULL if the free map cannot reserve room for
+ * it or memory runs out.  Caller holds INODE's lock. */
+static struct delayed_block *
+delayed_get (struct inode *inode, size_t idx) {
+	struct delayed_block *b;
+	size_t more;
+
+	b = delayed_find (inode, idx);
+	if (b != NULL)
+		return b;
+
+	more = reservation (inode->delayed_cnt + 1) - inode->reserved;
+	if (!free_map_reserve (more))
+		return NULL;
+	b = calloc (1, sizeof *b);
+	if (b == NULL) {
+		free_map_unreserve (more);
+		return NULL;
+	}
+	inode->reserved += more;
+	inode->delayed_cnt++;
+	b->idx = idx;
+	hash_insert (&inode->delayed, &b->hash_elem);
+	list_push_back (&inode->delayed_list, &b->list_elem);
+	return b;
+}
+
+/* Removes B from INODE's delayed blocks and frees it.  Caller holds
+ * INODE's lock. */
+static void
+delayed_remove (struct inode *inode, struct delayed_block *b) {
+	hash_delete (&inode->delayed, &b->hash_elem);
+	list_remove (&b->list_elem);
+	free (b);
+	inode->delayed_cnt--;
+}
+
+/* Frees INODE's delayed blocks and their reservation.  Caller holds
+ * INODE's lock. */
+static void
+delayed_discard (struct inode *inode) {
+	hash_clear (&inode->delayed, NULL);
+	while (!list_empty (&inode->delayed_list))
+		free (list_entry (list_pop_front (&inode->delayed_list),
+					struct delayed_block, list_elem));
+	inode->delayed_cnt = 0;
+	free_map_unreserve (inode->reserved);
+	inode->reserved = 0;
+}
+
+/* Gives INODE's delayed blocks sectors and moves their data to the
+ * buffer cache, then writes INODE's inode_disk back if it changed.
+ * Each run of consecutive blocks is placed in one extent right after
+ * the sector of the block before it, if there is one that long.
+ * Blocks that get no sector, or do not fit in the journal operation,
+ * stay delayed.  Returns true if INODE is left clean.  Caller holds
+ * INODE's lock, within a journal operation. */
+static bool
+inode_flush_locked (struct inode *inode) {
+	struct inode_disk *data = &inode->data;
+
+	if (inode->reserved != 0) {
+		free_map_unreserve (inode->reserved);
+		inode->reserved = 0;
+	}
+
+	while (!list_empty (&inode->delayed_list)) {
+		struct delayed_block *b = list_entry (
+				list_front (&inode->delayed_list), struct delayed_block,
+				list_elem);
+		size_t first = b->idx, run = 1;
+		disk_sector_t prev, goal, start, sector;
+		bool contiguous;
+
+		/* Take the oldest block's whole run. */
+		while (first > 0 && delayed_find (inode, first - 1) != NULL)
+			first--;
+		while (delayed_find (inode, first + run) != NULL)
+			run++;
+		prev = first > 0 ? index_to_sector (data, first - 1, NULL, 0) : 0;
+		goal = (prev != 0 ? prev : inode->sector) + 1;
+		contiguous = run > 1 && free_map_allocate_near (run, goal, &start);
+
+		for (size_t i = 0; i < run; i++) {
+			b = delayed_find (inode, first + i);
+			if (journal_room () < flush_cost (inode, b->idx)) {
+				if (contiguous)
+					free_map_release (start + i, run - i);
+				goto out;
+			}
+			if (contiguous)
+				sector = start + i;
+			else if (!free_map_allocate_near (1, goal, &sector))
+				goto out;
+
+			/* Indirect blocks go right after the data sector. */
+			goal = sector + 1;
+			if (index_to_sector (data, b->idx, &goal, sector) != sector) {
+				free_map_release (sector, contiguous ? run - i : 1);
+				goto out;
+			}
+			data_write (inode, sector, b->data, 0, DISK_SECTOR_SIZE);
+			delayed_remove (inode, b);
+			inode->dirty = true;
+		}
+	}
+
+out:
+	/* Whatever is left keeps a reservation if it can. */
+	if (inode->delayed_cnt != 0
+			&& free_map_reserve (reservation (inode->delayed_cnt)))
+		inode->reserved = reservation (inode->delayed_cnt);
+	if (inode->dirty && journal_room () > 0) {
+		journal_write (inode->sector, data, 0, DISK_SECTOR_SIZE);
+		inode->dirty = false;
+	}
+	return inode->delayed_cnt == 0 && !inode->dirty;
+}
+
 /* List of open inodes, so that opening a single inode twice
  * returns the same `struct inode'. */
-static struct list open_inodes;
+static struct hash open_inodes;
+
+/* Inodes no longer open but still in open_inodes, least recently
+ * closed first, at most INODE_CACHE_SIZE of them unless more still
+ * have data to flush. */
+static struct list closed_inodes;
+static size_t closed_cnt;
+
+/* Protects open_inodes, closed_inodes and every open_cnt. */
+static struct lock inode_lock;
+
+static uint64_t inode_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool inode_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED);
+static uint64_t delayed_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool delayed_less (const struct hash_elem *a,
+		const struct hash_elem *b, void *aux UNUSED);
 
 /* Initializes the inode module. */
 void
 inode_init (void) {
-	list_init (&open_inodes);
+	hash_init (&open_inodes, inode_hash, inode_less, NULL);
+	list_init (&closed_inodes);
+	lock_init (&inode_lock);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
  * writes the new inode to sector SECTOR on the file system
- * disk.
+ * disk.  No data sectors are allocated: the data reads as zeros
+ * until it is written.
  * Returns true if successful.
- * Returns false if memory or disk allocation fails. */
+ * Returns false if memory allocation fails or LENGTH is too long. */
 bool
 inode_create (disk_sector_t sector, off_t length) {
 	struct inode_disk *disk_inode = NULL;
@@ -75,65 +401,103 @@ inode_create (disk_sector_t sector, off_t length) {
 	 * one sector in size, and you should fix that. */
 	ASSERT (sizeof *disk_inode == DISK_SECTOR_SIZE);
 
+	if (length > MAX_LENGTH)
+		return false;
+
 	disk_inode = calloc (1, sizeof *disk_inode);
 	if (disk_inode != NULL) {
-		size_t sectors = bytes_to_sectors (length);
 		disk_inode->length = length;
 		disk_inode->magic = INODE_MAGIC;
-		if (free_map_allocate (sectors, &disk_inode->start)) {
-			disk_write (filesys_disk, sector, disk_inode);
-			if (sectors > 0) {
-				static char zeros[DISK_SECTOR_SIZE];
-				size_t i;
-
-				for (i = 0; i < sectors; i++) 
-					disk_write (filesys_disk, disk_inode->start + i, zeros); 
-			}
-			success = true; 
-		} 
+		journal_begin ();
+		journal_write (sector, disk_inode, 0, DISK_SECTOR_SIZE);
+		journal_end ();
+		success = true; 
 		free (disk_inode);
 	}
 	return success;
 }
 
+/* Removes the least recently closed inode that is clean from the inode
+ * cache and returns it, or returns NULL if every one still has data to
+ * flush; inode_flush_all() cleans them.  No one else can reach a
+ * closed inode, so its lock is not needed.  Caller holds inode_lock. */
+static struct inode *
+closed_victim (void) {
+	struct list_elem *e;
+
+	for (e = list_begin (&closed_inodes); e != list_end (&closed_inodes);
+			e = list_next (e)) {
+		struct inode *inode = list_entry (e, struct inode, lru_elem);
+
+		if (inode->delayed_cnt == 0 && !inode->dirty) {
+			list_remove (e);
+			hash_delete (&open_inodes, &inode->elem);
+			closed_cnt--;
+			return inode;
+		}
+	}
+	return NULL;
+}
+
 /* Reads an inode from SECTOR
  * and returns a `struct inode' that contains it.
  * Returns a null pointer if memory allocation fails. */
 struct inode *
 inode_open (disk_sector_t sector) {
-	struct list_elem *e;
+	struct inode key;
+	struct hash_elem *e;
 	struct inode *inode;
 
-	/* Check whether this inode is already open. */
-	for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-			e = list_next (e)) {
-		inode = list_entry (e, struct inode, elem);
-		if (inode->sector == sector) {
-			inode_reopen (inode);
-			return inode; 
+	lock_acquire (&inode_lock);
+
+	/* Check whether this inode is already open, or was closed
+	 * recently. */
+	key.sector = sector;
+	e = hash_find (&open_inodes, &key.elem);
+	if (e != NULL) {
+		inode = hash_entry (e, struct inode, elem);
+		if (inode->open_cnt++ == 0) {
+			list_remove (&inode->lru_elem);
+			closed_cnt--;
 		}
+		lock_release (&inode_lock);
+		return inode; 
 	}
 
 	/* Allocate memory. */
 	inode = malloc (sizeof *inode);
-	if (inode == NULL)
+	if (inode == NULL
+			|| !hash_init (&inode->delayed, delayed_hash, delayed_less, NULL)) {
+		free (inode);
+		lock_release (&inode_lock);
 		return NULL;
+	}
 
 	/* Initialize. */
-	list_push_front (&open_inodes, &inode->elem);
 	inode->sector = sector;
 	inode->open_cnt = 1;
 	inode->deny_write_cnt = 0;
 	inode->removed = false;
-	disk_read (filesys_disk, inode->sector, &inode->data);
+	inode->journaled = false;
+	lock_init (&inode->lock);
+	inode->dirty = false;
+	list_init (&inode->delayed_list);
+	inode->delayed_cnt = 0;
+	inode->reserved = 0;
+	page_cache_read (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+	hash_insert (&open_inodes, &inode->elem);
+	lock_release (&inode_lock);
 	return inode;
 }
 
 /* Reopens and returns INODE. */
 struct inode *
 inode_reopen (struct inode *inode) {
-	if (inode != NULL)
+	if (inode != NULL) {
+		lock_acquire (&inode_lock);
 		inode->open_cnt++;
+		lock_release (&inode_lock);
+	}
 	return inode;
 }
 
@@ -144,27 +508,60 @@ inode_get_inumber (const struct inode *inode) {
 }
 
 /* Closes INODE and writes it to disk.
- * If this was the last reference to INODE, frees its memory.
- * If INODE was also a removed inode, frees its blocks. */
+ * If this was the last reference to INODE, flushes it and keeps it in
+ * the inode cache, evicting the least recently closed inode if the
+ * cache is full.
+ * If INODE was also a removed inode, frees its memory and blocks. */
 void
 inode_close (struct inode *inode) {
+	struct inode *victim = NULL;
+
 	/* Ignore null pointer. */
 	if (inode == NULL)
 		return;
 
-	/* Release resources if this was the last opener. */
-	if (--inode->open_cnt == 0) {
-		/* Remove from inode list and release lock. */
-		list_remove (&inode->elem);
-
-		/* Deallocate blocks if removed. */
-		if (inode->removed) {
-			free_map_release (inode->sector, 1);
-			free_map_release (inode->data.start,
-					bytes_to_sectors (inode->data.length)); 
-		}
+	/* Flush what this is likely the last close of in operations of its
+	 * own, since below, with inode_lock held, there is only room for
+	 * what one operation may write. */
+	if (thread_current ()->journal_depth == 0 && inode->open_cnt == 1
+			&& !inode->removed)
+		inode_flush (inode);
+
+	journal_begin ();
+	lock_acquire (&inode_lock);
+	if (--inode->open_cnt > 0) {
+		lock_release (&inode_lock);
+		journal_end ();
+		return;
+	}
 
+	if (inode->removed) {
+		/* Remove from inode list and release lock. */
+		hash_delete (&open_inodes, &inode->elem);
+		lock_release (&inode_lock);
+
+		/* Deallocate blocks. */
+		delayed_discard (inode);
+		free_map_release (inode->sector, 1);
+		free_blocks (&inode->data);
+		hash_destroy (&inode->delayed, NULL);
 		free (inode); 
+		journal_end ();
+		return;
+	}
+
+	/* Cache it.  Once flushed, it can be dropped at any time. */
+	lock_acquire (&inode->lock);
+	inode_flush_locked (inode);
+	lock_release (&inode->lock);
+	list_push_back (&closed_inodes, &inode->lru_elem);
+	if (++closed_cnt > INODE_CACHE_SIZE)
+		victim = closed_victim ();
+	lock_release (&inode_lock);
+	journal_end ();
+	if (victim != NULL) {
+		hash_destroy (&victim->delayed, NULL);
+		free (victim);
 	}
 }
 
@@ -176,44 +573,124 @@ inode_remove (struct inode *inode) {
 	inode->removed = true;
 }
 
+/* Has INODE's data written through the journal, as metadata. */
+void
+inode_journal (struct inode *inode) {
+	inode->journaled = true;
+}
+
+/* Writes INODE's delayed blocks and inode_disk to the buffer cache,
+ * in as many journal operations as it takes.  Within an operation,
+ * writes only what fits in it. */
+void
+inode_flush (struct inode *inode) {
+	size_t left;
+	bool clean;
+
+	do {
+		journal_begin ();
+		lock_acquire (&inode->lock);
+		left = inode->delayed_cnt;
+		clean = inode_flush_locked (inode);
+		lock_release (&inode->lock);
+		journal_end ();
+	} while (!clean && thread_current ()->journal_depth == 0
+			&& inode->delayed_cnt < left);
+}
+
+/* Flushes every inode in memory.  Each is flushed in operations of its
+ * own, outside inode_lock, since the journal may have to commit in
+ * between. */
+void
+inode_flush_all (void) {
+	struct hash_iterator i;
+	struct list inodes;
+
+	ASSERT (thread_current ()->journal_depth == 0);
+
+	/* Hold each one open.  Open inodes do not use lru_elem. */
+	list_init (&inodes);
+	lock_acquire (&inode_lock);
+	hash_first (&i, &open_inodes);
+	while (hash_next (&i)) {
+		struct inode *inode = hash_entry (hash_cur (&i), struct inode, elem);
+
+		if (inode->open_cnt++ == 0) {
+			list_remove (&inode->lru_elem);
+			closed_cnt--;
+		}
+		list_push_back (&inodes, &inode->lru_elem);
+	}
+	lock_release (&inode_lock);
+
+	while (!list_empty (&inodes)) {
+		struct inode *inode = list_entry (list_pop_front (&inodes),
+				struct inode, lru_elem);
+
+		inode_flush (inode);
+		inode_close (inode);
+	}
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
  * Returns the number of bytes actually read, which may be less
- * than SIZE if an error occurs or end of file is reached. */
+ * than SIZE if an error occurs or end of file is reached.
+ * A user BUFFER may fault, and the fault may read this very file, so
+ * it is only touched outside INODE's lock, through a bounce buffer. */
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 	uint8_t *buffer = buffer_;
-	off_t bytes_read = 0;
 	uint8_t *bounce = NULL;
+	off_t bytes_read = 0;
+
+	if (!is_kernel_vaddr (buffer)) {
+		bounce = malloc (DISK_SECTOR_SIZE);
+		if (bounce == NULL)
+			return 0;
+	}
 
 	while (size > 0) {
-		/* Disk sector to read, starting byte offset within sector. */
-		disk_sector_t sector_idx = byte_to_sector (inode, offset);
+		uint8_t *dst = bounce != NULL ? bounce : buffer + bytes_read;
+		disk_sector_t sector_idx, next = 0;
 		int sector_ofs = offset % DISK_SECTOR_SIZE;
+		int sector_left = DISK_SECTOR_SIZE - sector_ofs;
+		off_t inode_left;
+		int min_left, chunk_size;
+
+		lock_acquire (&inode->lock);
 
 		/* Bytes left in inode, bytes left in sector, lesser of the two. */
-		off_t inode_left = inode_length (inode) - offset;
-		int sector_left = DISK_SECTOR_SIZE - sector_ofs;
-		int min_left = inode_left < sector_left ? inode_left : sector_left;
+		inode_left = inode_length (inode) - offset;
+		min_left = inode_left < sector_left ? inode_left : sector_left;
 
 		/* Number of bytes to actually copy out of this sector. */
-		int chunk_size = size < min_left ? size : min_left;
-		if (chunk_size <= 0)
+		chunk_size = size < min_left ? size : min_left;
+		if (chunk_size <= 0) {
+			lock_release (&inode->lock);
 			break;
+		}
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
-			/* Read full sector directly into caller's buffer. */
-			disk_read (filesys_disk, sector_idx, buffer + bytes_read); 
-		} else {
-			/* Read sector into bounce buffer, then partially copy
-			 * into caller's buffer. */
-			if (bounce == NULL) {
-				bounce = malloc (DISK_SECTOR_SIZE);
-				if (bounce == NULL)
-					break;
-			}
-			disk_read (filesys_disk, sector_idx, bounce);
-			memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
+		sector_idx = byte_to_sector (inode, offset);
+		if (sector_idx != 0)
+			page_cache_read (sector_idx, dst, sector_ofs, chunk_size);
+		else {
+			/* No sector: a delayed block, or a hole. */
+			struct delayed_block *b = delayed_find (inode,
+					offset / DISK_SECTOR_SIZE);
+			if (b != NULL)
+				memcpy (dst, b->data + sector_ofs, chunk_size);
+			else
+				memset (dst, 0, chunk_size);
 		}
+		if (inode_left > sector_left)
+			next = byte_to_sector (inode, offset + sector_left);
+		lock_release (&inode->lock);
+
+		/* Have the next sector read while this one is used. */
+		if (next != 0)
+			page_cache_prefetch (next);
+		if (bounce != NULL)
+			memcpy (buffer + bytes_read, bounce, chunk_size);
 
 		/* Advance. */
 		size -= chunk_size;
@@ -227,55 +704,70 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
  * Returns the number of bytes actually written, which may be
- * less than SIZE if end of file is reached or an error occurs.
- * (Normally a write at end of file would extend the inode, but
- * growth is not yet implemented.) */
+ * less than SIZE if the disk fills up or an error occurs.
+ * A write past end of file extends the inode, and any gap
+ * before OFFSET reads back as zeros.
+ * Data for blocks without a sector is kept in delayed blocks, which
+ * get sectors when the inode is flushed, or once there are DELAYED_MAX
+ * of them.  Each sector is written in a journal operation of its own,
+ * or within the caller's, and a user BUFFER is read outside INODE's
+ * lock, as in inode_read_at(). */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 		off_t offset) {
 	const uint8_t *buffer = buffer_;
-	off_t bytes_written = 0;
 	uint8_t *bounce = NULL;
+	off_t bytes_written = 0;
 
 	if (inode->deny_write_cnt)
 		return 0;
+	if (size > MAX_LENGTH - offset)
+		size = offset < MAX_LENGTH ? MAX_LENGTH - offset : 0;
+	if (size > 0 && !is_kernel_vaddr (buffer)) {
+		bounce = malloc (DISK_SECTOR_SIZE);
+		if (bounce == NULL)
+			return 0;
+	}
 
 	while (size > 0) {
-		/* Sector to write, starting byte offset within sector. */
-		disk_sector_t sector_idx = byte_to_sector (inode, offset);
+		const uint8_t *src = buffer + bytes_written;
+		disk_sector_t sector_idx;
+		size_t idx = offset / DISK_SECTOR_SIZE;
 		int sector_ofs = offset % DISK_SECTOR_SIZE;
-
-		/* Bytes left in inode, bytes left in sector, lesser of the two. */
-		off_t inode_left = inode_length (inode) - offset;
 		int sector_left = DISK_SECTOR_SIZE - sector_ofs;
-		int min_left = inode_left < sector_left ? inode_left : sector_left;
+		int chunk_size = size < sector_left ? size : sector_left;
+		bool written = true;
 
-		/* Number of bytes to actually write into this sector. */
-		int chunk_size = size < min_left ? size : min_left;
-		if (chunk_size <= 0)
-			break;
+		if (bounce != NULL) {
+			memcpy (bounce, src, chunk_size);
+			src = bounce;
+		}
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
-			/* Write full sector directly to disk. */
-			disk_write (filesys_disk, sector_idx, buffer + bytes_written); 
+		journal_begin ();
+		lock_acquire (&inode->lock);
+		sector_idx = index_to_sector (&inode->data, idx, NULL, 0);
+		if (sector_idx != 0) {
+			/* The cache reads in the rest of the sector if the chunk
+			 * does not cover all of it. */
+			data_write (inode, sector_idx, src, sector_ofs, chunk_size);
 		} else {
-			/* We need a bounce buffer. */
-			if (bounce == NULL) {
-				bounce = malloc (DISK_SECTOR_SIZE);
-				if (bounce == NULL)
-					break;
-			}
+			struct delayed_block *b = delayed_get (inode, idx);
+			if (b != NULL)
+				memcpy (b->data + sector_ofs, src, chunk_size);
+			written = b != NULL;
+		}
 
-			/* If the sector contains data before or after the chunk
-			   we're writing, then we need to read in the sector
-			   first.  Otherwise we start with a sector of all zeros. */
-			if (sector_ofs > 0 || chunk_size < sector_left) 
-				disk_read (filesys_disk, sector_idx, bounce);
-			else
-				memset (bounce, 0, DISK_SECTOR_SIZE);
-			memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-			disk_write (filesys_disk, sector_idx, bounce); 
+		/* The file only grows as far as was written. */
+		if (written && offset + chunk_size > inode->data.length) {
+			inode->data.length = offset + chunk_size;
+			inode->dirty = true;
 		}
+		if (inode->delayed_cnt >= DELAYED_MAX)
+			inode_flush_locked (inode);
+		lock_release (&inode->lock);
+		journal_end ();
+		if (!written)
+			break;
 
 		/* Advance. */
 		size -= chunk_size;
@@ -283,6 +775,9 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 		bytes_written += chunk_size;
 	}
 	free (bounce);
+#ifdef VM
+	share_invalidate (inode, offset - bytes_written, bytes_written);
+#endif
 
 	return bytes_written;
 }
@@ -311,3 +806,30 @@ off_t
 inode_length (const struct inode *inode) {
 	return inode->data.length;
 }
+
+static uint64_t
+inode_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct inode *inode = hash_entry (e, struct inode, elem);
+	return hash_int (inode->sector);
+}
+
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct inode, elem)->sector
+		< hash_entry (b, struct inode, elem)->sector;
+}
+
+static uint64_t
+delayed_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct delayed_block *b = hash_entry (e, struct delayed_block,
+			hash_elem);
+	return hash_int (b->idx);
+}
+
+static bool
+delayed_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct delayed_block, hash_elem)->idx
+		< hash_entry (b, struct delayed_block, hash_elem)->idx;
+}
@@ -0,0 +1,294 @@
+/* journal.c: Write-ahead journal of file system metadata.
+ *
+ * Metadata sectors -- inodes, indirect blocks, directories, and the
+ * free map or the FAT -- are written with journal_write().  The new
+ * contents stay pinned in the buffer cache, and the sector joins the
+ * running transaction.  Each operation brackets its writes with
+ * journal_begin() and journal_end().  Any number of operations share a
+ * transaction, which is committed once none is in progress and it is
+ * nearly full or someone waits for it in journal_sync(): a group
+ * commit.
+ *
+ * A commit first writes the free map or the FAT into the transaction,
+ * and writes back the cache's other dirty sectors, so that file data
+ * reaches the disk before the metadata that points to it.  It then
+ * copies the transaction's sectors to the log and writes the header
+ * that lists them, which is the commit point.  Last, it writes the
+ * sectors home and clears the header.  journal_init() replays a
+ * transaction whose header was written, so after a crash either all
+ * of a transaction's metadata is on disk or none of it is.
+ *
+ * Every sector of the transaction goes through the log.  The log has
+ * room for every sector of the free map or the FAT, whatever the
+ * operations changed, and for LOG_OPS more.  Each operation is
+ * admitted with room for OP_MAX sectors, and operations that could
+ * write more, like flushing an inode, check journal_room() and leave
+ * the rest for a later operation. */
+
+#include "filesys/journal.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/free-map.h"
+#include "filesys/page_cache.h"
+#ifdef EFILESYS
+#include "filesys/fat.h"
+#endif
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Identifies the journal header. */
+#define JOURNAL_MAGIC 0x4a524e4c
+
+/* Sectors of the log for operations, and sectors one operation may
+ * write. */
+#define LOG_OPS 128
+#define OP_MAX 32
+
+/* Journal header, the first header_sectors sectors of the journal.
+ * The first sector, with the count, is written last. */
+struct journal_header {
+	unsigned magic;                     /* Magic number. */
+	unsigned cnt;                       /* Sectors committed, 0 if none. */
+	disk_sector_t sectors[];            /* Where each log sector goes. */
+};
+
+static struct journal_header *header;
+static size_t header_sectors;           /* Sectors in the header. */
+static size_t log_max;                  /* Sectors the log holds. */
+static uint8_t bounce[DISK_SECTOR_SIZE];
+
+/* The running transaction. */
+static disk_sector_t *logged;           /* Sectors logged. */
+static size_t logged_cnt;
+static int outstanding;                 /* Operations in progress. */
+static bool committing;                 /* Being committed? */
+static bool commit_wanted;              /* Awaited by journal_sync()? */
+static unsigned long long seq;          /* Number of the transaction. */
+static unsigned long long committed;    /* Last committed transaction. */
+
+/* Protects all of the above but header and bounce, which only the
+ * committing thread uses. */
+static struct lock journal_lock;
+static struct condition journal_cond;
+
+/* Statistics. */
+static long long commit_cnt, logged_total;
+
+static size_t map_sectors (void);
+static void header_write (size_t cnt);
+static void commit (void);
+
+/* Returns the number of sectors the journal takes at the end of the
+ * file system disk: the header and the log. */
+size_t
+journal_sectors (void) {
+	size_t max = LOG_OPS + map_sectors ();
+
+	return DIV_ROUND_UP (sizeof *header + max * sizeof *header->sectors,
+			DISK_SECTOR_SIZE) + max;
+}
+
+/* Sets up the journal, replaying the last transaction if its commit
+ * reached the disk.  Must run before anything else reads the file
+ * system disk. */
+void
+journal_init (void) {
+	lock_init (&journal_lock);
+	cond_init (&journal_cond);
+	seq = 1;
+
+	log_max = LOG_OPS + map_sectors ();
+	header_sectors = journal_sectors () - log_max;
+	header = malloc (header_sectors * DISK_SECTOR_SIZE);
+	logged = malloc (log_max * sizeof *logged);
+	if (header == NULL || logged == NULL)
+		PANIC ("journal allocation failed");
+
+	for (size_t i = 0; i < header_sectors; i++)
+		disk_read (filesys_disk, JOURNAL_SECTOR + i,
+				(uint8_t *) header + i * DISK_SECTOR_SIZE);
+	if (header->magic == JOURNAL_MAGIC && header->cnt > 0
+			&& header->cnt <= log_max) {
+		printf ("Replaying journal: %u sectors\n", header->cnt);
+		for (unsigned i = 0; i < header->cnt; i++) {
+			disk_read (filesys_disk, JOURNAL_SECTOR + header_sectors + i,
+					bounce);
+			disk_write (filesys_disk, header->sectors[i], bounce);
+		}
+	}
+	if (header->magic != JOURNAL_MAGIC || header->cnt != 0) {
+		memset (header, 0, header_sectors * DISK_SECTOR_SIZE);
+		header->magic = JOURNAL_MAGIC;
+		header_write (header_sectors);
+	}
+}
+
+/* Starts an operation.  Its journal_write() calls become part of one
+ * transaction.  Operations may nest; only the outermost counts. */
+void
+journal_begin (void) {
+	if (thread_current ()->journal_depth++ > 0)
+		return;
+
+	lock_acquire (&journal_lock);
+	while (committing || logged_cnt + (outstanding + 1) * OP_MAX > LOG_OPS) {
+		if (outstanding == 0 && !committing)
+			commit ();
+		else
+			cond_wait (&journal_cond, &journal_lock);
+	}
+	outstanding++;
+	lock_release (&journal_lock);
+	thread_current ()->journal_used = 0;
+}
+
+/* Ends an operation started by journal_begin().  The last operation
+ * to end commits the transaction if it is nearly full or awaited. */
+void
+journal_end (void) {
+	struct thread *t = thread_current ();
+
+	ASSERT (t->journal_depth > 0);
+	if (--t->journal_depth > 0)
+		return;
+
+	lock_acquire (&journal_lock);
+	outstanding--;
+	if (outstanding == 0 && (commit_wanted || logged_cnt + OP_MAX > LOG_OPS))
+		commit ();
+	else
+		cond_broadcast (&journal_cond, &journal_lock);
+	lock_release (&journal_lock);
+}
+
+/* Returns how many more sectors the current operation may log. */
+size_t
+journal_room (void) {
+	struct thread *t = thread_current ();
+
+	ASSERT (t->journal_depth > 0);
+	return t->journal_used < OP_MAX ? OP_MAX - t->journal_used : 0;
+}
+
+/* Copies SIZE bytes from BUFFER to offset OFS of metadata sector
+ * SECTOR as part of the running transaction.  Must be called within
+ * an operation. */
+void
+journal_write (disk_sector_t sector, const void *buffer, off_t ofs,
+		size_t size) {
+	struct thread *t = thread_current ();
+	bool logging = false;
+
+	ASSERT (t->journal_depth > 0);
+
+	lock_acquire (&journal_lock);
+	for (size_t i = 0; i < logged_cnt && !logging; i++)
+		logging = logged[i] == sector;
+	if (!logging) {
+		/* Only the commit writes into the free map's room. */
+		ASSERT (logged_cnt < (committing ? log_max : LOG_OPS));
+		logged[logged_cnt++] = sector;
+		logged_total++;
+		t->journal_used++;
+	}
+	lock_release (&journal_lock);
+
+	page_cache_log (sector, buffer, ofs, size);
+}
+
+/* Waits until everything written by operations that have ended is
+ * committed.  Callers arriving while operations are in progress share
+ * the commit that follows the last of them. */
+void
+journal_sync (void) {
+	unsigned long long target;
+
+	ASSERT (thread_current ()->journal_depth == 0);
+
+	lock_acquire (&journal_lock);
+	target = seq;
+	commit_wanted = true;
+	while (committed < target) {
+		if (outstanding == 0 && !committing)
+			commit ();
+		else
+			cond_wait (&journal_cond, &journal_lock);
+	}
+	lock_release (&journal_lock);
+}
+
+/* Prints journal statistics. */
+void
+journal_print_stats (void) {
+	printf ("Journal: %lld commits, %lld sectors logged\n",
+			commit_cnt, logged_total);
+}
+
+/* Returns an upper bound on the sectors of the free map or the FAT,
+ * which a commit may have to log all of. */
+static size_t
+map_sectors (void) {
+#ifdef EFILESYS
+	return DIV_ROUND_UP (disk_size (filesys_disk),
+			DISK_SECTOR_SIZE / sizeof (cluster_t));
+#else
+	return DIV_ROUND_UP (disk_size (filesys_disk), DISK_SECTOR_SIZE * 8);
+#endif
+}
+
+/* Writes the first CNT sectors of the header, the first one last, so
+ * that the count reaches the disk only after the entries it covers. */
+static void
+header_write (size_t cnt) {
+	for (size_t i = cnt; i-- > 0; )
+		disk_write (filesys_disk, JOURNAL_SECTOR + i,
+				(uint8_t *) header + i * DISK_SECTOR_SIZE);
+}
+
+/* Commits the running transaction and starts the next.  Caller holds
+ * journal_lock, and no operation is in progress. */
+static void
+commit (void) {
+	struct thread *t = thread_current ();
+
+	committing = true;
+	lock_release (&journal_lock);
+
+	/* The free map is written as if by an operation within the
+	 * transaction, and only now, when it matches the metadata. */
+	t->journal_depth++;
+#ifdef EFILESYS
+	fat_sync ();
+#else
+	free_map_sync ();
+#endif
+	t->journal_depth--;
+	page_cache_flush ();
+
+	if (logged_cnt > 0) {
+		for (size_t i = 0; i < logged_cnt; i++) {
+			page_cache_read (logged[i], bounce, 0, DISK_SECTOR_SIZE);
+			disk_write (filesys_disk, JOURNAL_SECTOR + header_sectors + i,
+					bounce);
+		}
+		header->cnt = logged_cnt;
+		memcpy (header->sectors, logged, logged_cnt * sizeof *logged);
+		header_write (header_sectors);
+
+		for (size_t i = 0; i < logged_cnt; i++)
+			page_cache_unpin (logged[i]);
+		header->cnt = 0;
+		header_write (1);
+		commit_cnt++;
+	}
+
+	lock_acquire (&journal_lock);
+	logged_cnt = 0;
+	committing = false;
+	commit_wanted = false;
+	committed = seq++;
+	cond_broadcast (&journal_cond, &journal_lock);
+}
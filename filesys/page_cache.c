@@ -1,9 +1,83 @@
-/* page_cache.c: Implementation of Page Cache (Buffer Cache). */
+/* page_cache.c: Implementation of Page Cache (Buffer Cache).
+ *
+ * File system sectors are cached in sector-sized entries, replaced by
+ * second-chance clock.  Writes only dirty the cached copy;
+ * page_cache_kworkerd writes dirty entries back every FLUSH_TICKS, and
+ * page_cache_flush() writes back everything at shutdown.  A reader may
+ * ask for the sector it will want next, which page_cache_readaheadd
+ * loads in the background.  Sectors logged by the journal are pinned:
+ * they are neither evicted nor written back until the journal has
+ * committed them and calls page_cache_unpin().  The cache has an entry
+ * for each sector the journal may pin, beside CACHE_SIZE others, so
+ * there is always one to evict.  Entries are found by sector through
+ * cache_map.
+ *
+ * The cache is guarded by cache_lock, but disk transfers and copies to
+ * and from callers' buffers are done without it, on an entry marked
+ * busy, which no one else uses or evicts meanwhile. */
 
+#include "filesys/page_cache.h"
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 #include "vm/vm.h"
+
+/* Number of cached sectors that are not pinned. */
+#define CACHE_SIZE 64
+
+/* Ticks between write-behind passes. */
+#define FLUSH_TICKS TIMER_FREQ
+
+/* Read-ahead requests that may be pending at once.  Further requests
+ * are dropped. */
+#define READAHEAD_MAX 8
+
+/* A cached sector. */
+struct cache_entry {
+	struct hash_elem elem;              /* Element in cache_map if valid. */
+	disk_sector_t sector;               /* Sector held, if valid. */
+	bool valid;                         /* Holds a sector? */
+	bool dirty;                         /* Modified since read or written? */
+	bool accessed;                      /* Used since the hand passed? */
+	bool pinned;                        /* Logged, not yet committed? */
+	bool busy;                          /* In use without cache_lock? */
+	uint8_t data[DISK_SECTOR_SIZE];     /* Sector contents. */
+};
+
+static struct cache_entry *cache;
+static size_t cache_cnt;                /* Number of entries in cache. */
+static struct hash cache_map;           /* Valid entries, by sector. */
+static struct lock cache_lock;
+static struct condition cache_idle;     /* An entry is no longer busy. */
+static size_t hand;                     /* Clock hand, an index in cache. */
+
+/* Pending read-ahead requests, a ring guarded by cache_lock. */
+static disk_sector_t ra_queue[READAHEAD_MAX];
+static size_t ra_head, ra_cnt;
+static struct semaphore ra_sema;        /* Up once per queued request. */
+
+/* Statistics. */
+static long long hit_cnt, miss_cnt, readahead_cnt, writeback_cnt;
+
 static bool page_cache_readahead (struct page *page, void *kva);
 static bool page_cache_writeback (struct page *page);
 static void page_cache_destroy (struct page *page);
+static void page_cache_kworkerd (void *aux);
+static void page_cache_readaheadd (void *aux);
+static struct cache_entry *cache_lookup (disk_sector_t sector);
+static uint64_t cache_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool cache_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED);
+static struct cache_entry *cache_get (disk_sector_t sector, bool fill);
+static void cache_put (struct cache_entry *e);
+static struct cache_entry *cache_evict (void);
+static void cache_write_back (struct cache_entry *e);
 
 /* DO NOT MODIFY this struct */
 static const struct page_operations page_cache_op = {
@@ -15,10 +89,11 @@ static const struct page_operations page_cache_op = {
 
 tid_t page_cache_workerd;
 
-/* The initializer of file vm */
+/* The initializer of file vm.  The sector cache is set up by
+ * page_cache_init() at file system start-up, which must work without
+ * VM, so there is nothing left to do here. */
 void
 pagecache_init (void) {
-	/* TODO: Create a worker daemon for page cache with page_cache_kworkerd */
 }
 
 /* Initialize the page cache */
@@ -26,25 +101,291 @@ bool
 page_cache_initializer (struct page *page, enum vm_type type, void *kva) {
 	/* Set up the handler */
 	page->operations = &page_cache_op;
-
+	return true;
 }
 
-/* Utilze the Swap in mechanism to implement readhead */
+/* No page is ever of type VM_PAGE_CACHE: file data is cached by
+ * sector, below, and mapped pages go through file-backed pages. */
 static bool
 page_cache_readahead (struct page *page, void *kva) {
+	return false;
 }
 
-/* Utilze the Swap out mechanism to implement writeback */
 static bool
 page_cache_writeback (struct page *page) {
+	return false;
 }
 
-/* Destory the page_cache. */
 static void
 page_cache_destroy (struct page *page) {
 }
 
-/* Worker thread for page cache */
+/* Sets up the sector cache and starts its worker threads. */
+void
+page_cache_init (void) {
+	cache_cnt = CACHE_SIZE + JOURNAL_SECTORS;
+	cache = calloc (cache_cnt, sizeof *cache);
+	if (cache == NULL
+			|| !hash_init (&cache_map, cache_hash, cache_less, NULL))
+		PANIC ("buffer cache allocation failed");
+	lock_init (&cache_lock);
+	cond_init (&cache_idle);
+	sema_init (&ra_sema, 0);
+	page_cache_workerd = thread_create ("bc_flush", PRI_DEFAULT,
+			page_cache_kworkerd, NULL);
+	thread_create ("bc_readahead", PRI_DEFAULT, page_cache_readaheadd, NULL);
+}
+
+/* Copies SIZE bytes at offset OFS of SECTOR into BUFFER. */
+void
+page_cache_read (disk_sector_t sector, void *buffer, off_t ofs, size_t size) {
+	struct cache_entry *e;
+
+	ASSERT (ofs >= 0 && ofs + size <= DISK_SECTOR_SIZE);
+
+	lock_acquire (&cache_lock);
+	e = cache_get (sector, true);
+	lock_release (&cache_lock);
+	memcpy (buffer, e->data + ofs, size);
+	lock_acquire (&cache_lock);
+	cache_put (e);
+	lock_release (&cache_lock);
+}
+
+/* Copies SIZE bytes from BUFFER to offset OFS of SECTOR, and pins the
+ * sector if PIN.  Caller holds cache_lock. */
 static void
-page_cache_kworkerd (void *aux) {
+cache_write (disk_sector_t sector, const void *buffer, off_t ofs,
+		size_t size, bool pin) {
+	struct cache_entry *e = cache_get (sector, size < DISK_SECTOR_SIZE);
+
+	lock_release (&cache_lock);
+	memcpy (e->data + ofs, buffer, size);
+	lock_acquire (&cache_lock);
+	e->dirty = true;
+	if (pin)
+		e->pinned = true;
+	cache_put (e);
+}
+
+/* Copies SIZE bytes from BUFFER to offset OFS of SECTOR.  The sector
+ * reaches the disk later, when written back. */
+void
+page_cache_write (disk_sector_t sector, const void *buffer, off_t ofs,
+		size_t size) {
+	ASSERT (ofs >= 0 && ofs + size <= DISK_SECTOR_SIZE);
+
+	lock_acquire (&cache_lock);
+	cache_write (sector, buffer, ofs, size, false);
+	lock_release (&cache_lock);
+}
+
+/* Like page_cache_write(), but pins SECTOR in the cache until
+ * page_cache_unpin(). */
+void
+page_cache_log (disk_sector_t sector, const void *buffer, off_t ofs,
+		size_t size) {
+	ASSERT (ofs >= 0 && ofs + size <= DISK_SECTOR_SIZE);
+
+	lock_acquire (&cache_lock);
+	cache_write (sector, buffer, ofs, size, true);
+	lock_release (&cache_lock);
+}
+
+/* Unpins SECTOR and writes it back to disk.  A pinned sector is never
+ * evicted, so it stays put while this waits for it. */
+void
+page_cache_unpin (disk_sector_t sector) {
+	lock_acquire (&cache_lock);
+	struct cache_entry *e = cache_lookup (sector);
+	if (e != NULL) {
+		while (e->busy)
+			cond_wait (&cache_idle, &cache_lock);
+		e->pinned = false;
+		if (e->dirty) {
+			e->busy = true;
+			cache_write_back (e);
+			cache_put (e);
+		}
+	}
+	lock_release (&cache_lock);
+}
+
+/* Asks for SECTOR to be read into the cache in the background. */
+void
+page_cache_prefetch (disk_sector_t sector) {
+	lock_acquire (&cache_lock);
+	if (ra_cnt < READAHEAD_MAX && cache_lookup (sector) == NULL) {
+		ra_queue[(ra_head + ra_cnt++) % READAHEAD_MAX] = sector;
+		sema_up (&ra_sema);
+	}
+	lock_release (&cache_lock);
+}
+
+/* Writes every dirty sector that is not pinned back to disk.  Busy
+ * entries are waited for, so that a write in progress is not missed. */
+void
+page_cache_flush (void) {
+	lock_acquire (&cache_lock);
+	for (size_t i = 0; i < cache_cnt; i++) {
+		struct cache_entry *e = &cache[i];
+
+		while (e->busy)
+			cond_wait (&cache_idle, &cache_lock);
+		if (e->valid && e->dirty && !e->pinned) {
+			e->busy = true;
+			cache_write_back (e);
+			cache_put (e);
+		}
+	}
+	lock_release (&cache_lock);
+}
+
+/* Prints cache statistics. */
+void
+page_cache_print_stats (void) {
+	printf ("Buffer cache: %lld hits, %lld misses, %lld read ahead, "
+			"%lld written back\n", hit_cnt, miss_cnt, readahead_cnt,
+			writeback_cnt);
+}
+
+/* Worker thread for page cache: periodic write-behind, of the
+ * metadata too. */
+static void
+page_cache_kworkerd (void *aux UNUSED) {
+	for (;;) {
+		timer_sleep (FLUSH_TICKS);
+		filesys_sync ();
+	}
+}
+
+/* Worker thread that serves read-ahead requests. */
+static void
+page_cache_readaheadd (void *aux UNUSED) {
+	for (;;) {
+		sema_down (&ra_sema);
+		lock_acquire (&cache_lock);
+		disk_sector_t sector = ra_queue[ra_head];
+		ra_head = (ra_head + 1) % READAHEAD_MAX;
+		ra_cnt--;
+		if (cache_lookup (sector) == NULL) {
+			cache_put (cache_get (sector, true));
+			readahead_cnt++;
+		}
+		lock_release (&cache_lock);
+	}
+}
+
+/* Returns the entry holding SECTOR, or NULL.  Caller holds
+ * cache_lock. */
+static struct cache_entry *
+cache_lookup (disk_sector_t sector) {
+	struct cache_entry key;
+	struct hash_elem *e;
+
+	key.sector = sector;
+	e = hash_find (&cache_map, &key.elem);
+	return e != NULL ? hash_entry (e, struct cache_entry, elem) : NULL;
+}
+
+/* Returns the entry holding SECTOR, marked accessed and busy for the
+ * caller, who may then use it without cache_lock and must give it
+ * back with cache_put().  If SECTOR is not cached, another sector that
+ * is neither busy nor pinned is evicted for it, and SECTOR is read
+ * from disk if FILL, or left with stale contents otherwise.  Caller
+ * holds cache_lock, which is released while waiting for an entry or
+ * for the disk. */
+static struct cache_entry *
+cache_get (disk_sector_t sector, bool fill) {
+	struct cache_entry *e;
+
+	for (;;) {
+		e = cache_lookup (sector);
+		if (e != NULL && !e->busy) {
+			hit_cnt++;
+			e->accessed = true;
+			e->busy = true;
+			return e;
+		}
+		if (e == NULL) {
+			e = cache_evict ();
+			if (e != NULL && !(e->valid && e->dirty))
+				break;
+			if (e != NULL) {
+				/* SECTOR may be loaded by someone else meanwhile, so
+				 * look again afterward. */
+				e->busy = true;
+				cache_write_back (e);
+				cache_put (e);
+				continue;
+			}
+		}
+		cond_wait (&cache_idle, &cache_lock);
+	}
+
+	miss_cnt++;
+	if (e->valid)
+		hash_delete (&cache_map, &e->elem);
+	e->sector = sector;
+	e->valid = true;
+	hash_insert (&cache_map, &e->elem);
+	e->dirty = false;
+	e->accessed = true;
+	e->pinned = false;
+	e->busy = true;
+	if (fill) {
+		lock_release (&cache_lock);
+		disk_read (filesys_disk, sector, e->data);
+		lock_acquire (&cache_lock);
+	}
+	return e;
+}
+
+/* Gives back E, got from cache_get().  Caller holds cache_lock. */
+static void
+cache_put (struct cache_entry *e) {
+	ASSERT (e->busy);
+	e->busy = false;
+	cond_broadcast (&cache_idle, &cache_lock);
+}
+
+/* Returns an entry that is neither busy nor pinned, chosen by the
+ * clock, or NULL if there is none.  Caller holds cache_lock. */
+static struct cache_entry *
+cache_evict (void) {
+	for (size_t i = 0; i < 2 * cache_cnt; i++) {
+		struct cache_entry *e = &cache[hand];
+
+		hand = (hand + 1) % cache_cnt;
+		if (e->busy || e->pinned)
+			continue;
+		if (!e->valid || !e->accessed)
+			return e;
+		e->accessed = false;
+	}
+	return NULL;
+}
+
+/* Writes E, which the caller has marked busy, back to disk.  Caller
+ * holds cache_lock, which is released during the transfer. */
+static void
+cache_write_back (struct cache_entry *e) {
+	ASSERT (e->busy);
+	lock_release (&cache_lock);
+	disk_write (filesys_disk, e->sector, e->data);
+	lock_acquire (&cache_lock);
+	e->dirty = false;
+	writeback_cnt++;
+}
+
+static uint64_t
+cache_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_int (hash_entry (e, struct cache_entry, elem)->sector);
+}
+
+static bool
+cache_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct cache_entry, elem)->sector
+		< hash_entry (b, struct cache_entry, elem)->sector;
 }
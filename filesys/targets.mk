@@ -3,6 +3,8 @@ filesys_SRC += filesys/fat.c		# FAT.
 filesys_SRC += filesys/free-map.c	# Free sector bitmap.
 filesys_SRC += filesys/file.c		# Files.
 filesys_SRC += filesys/directory.c	# Directories.
+filesys_SRC += filesys/dcache.c		# Directory lookup cache.
 filesys_SRC += filesys/inode.c		# File headers.
+filesys_SRC += filesys/journal.c	# Metadata journal.
 filesys_SRC += filesys/fsutil.c		# Utilities.
 filesys_SRC += filesys/page_cache.c		# Page cache.
@@ -0,0 +1,14 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/disk.h"
+
+void dcache_init (void);
+bool dcache_lookup (disk_sector_t parent, const char *name,
+		disk_sector_t *sectorp);
+void dcache_insert (disk_sector_t parent, const char *name,
+		disk_sector_t sector, bool overwrite);
+void dcache_purge (disk_sector_t parent);
+
+#endif /* filesys/dcache.h */
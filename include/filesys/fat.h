@@ -21,6 +21,7 @@ typedef uint32_t cluster_t;  /* Index of a cluster within FAT. */
 void fat_init (void);
 void fat_open (void);
 void fat_close (void);
+void fat_sync (void);
 void fat_create (void);
 void fat_close (void);
 
@@ -34,5 +35,7 @@ void fat_remove_chain (
 cluster_t fat_get (cluster_t clst);
 void fat_put (cluster_t clst, cluster_t val);
 disk_sector_t cluster_to_sector (cluster_t clst);
+cluster_t sector_to_cluster (disk_sector_t sector);
+size_t fat_free_count (void);
 
 #endif /* filesys/fat.h */
@@ -19,5 +19,8 @@ off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
+void inode_journal (struct inode *);
+void inode_flush (struct inode *);
+void inode_flush_all (void);
 
 #endif /* filesys/inode.h */
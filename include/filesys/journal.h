@@ -0,0 +1,23 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stddef.h>
+#include "devices/disk.h"
+#include "filesys/filesys.h"
+#include "filesys/off_t.h"
+
+/* The journal: its header and the log, at the end of the disk. */
+#define JOURNAL_SECTORS journal_sectors ()
+#define JOURNAL_SECTOR (disk_size (filesys_disk) - JOURNAL_SECTORS)
+
+size_t journal_sectors (void);
+void journal_init (void);
+void journal_begin (void);
+void journal_end (void);
+size_t journal_room (void);
+void journal_write (disk_sector_t sector, const void *buffer, off_t ofs,
+		size_t size);
+void journal_sync (void);
+void journal_print_stats (void);
+
+#endif /* filesys/journal.h */
@@ -36,6 +36,34 @@ static __inline void invlpg(uint64_t addr) {
 	__asm __volatile("invlpg (%0)" : : "r" (addr) : "memory");
 }
 
+/* Invalidates the TLB entries selected by TYPE and DESC, which holds
+   a PCID and an address.  See [IA32-v2a] "INVPCID". */
+__attribute__((always_inline))
+static __inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+	struct { uint64_t pcid; uint64_t addr; } desc = { pcid, addr };
+	__asm __volatile("invpcid %0, %1" : : "m" (desc), "r" (type) : "memory");
+}
+
+__attribute__((always_inline))
+static __inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+		uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+	__asm __volatile("cpuid"
+			: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+			: "a" (leaf), "c" (subleaf));
+}
+
+__attribute__((always_inline))
+static __inline uint64_t rcr4(void) {
+	uint64_t val;
+	__asm __volatile("movq %%cr4,%0" : "=r" (val));
+	return val;
+}
+
+__attribute__((always_inline))
+static __inline void lcr4(uint64_t val) {
+	__asm __volatile("movq %0, %%cr4" : : "r" (val));
+}
+
 __attribute__((always_inline))
 static __inline uint64_t read_eflags(void) {
 	uint64_t rflags;
@@ -36,6 +36,15 @@ enum {
 
 	SYS_MOUNT,
 	SYS_UMOUNT,
+
+	/* Virtual memory extensions. */
+	SYS_MADVISE,                /* Advise on a range's access pattern. */
+	SYS_MSYNC,                  /* Write a mapping back to its file. */
+	SYS_MEMSTAT,                /* Report a process's memory use. */
+	SYS_OOM_SCORE_ADJ,          /* Bias the OOM killer's choice. */
+
+	/* File system extensions. */
+	SYS_FSYNC,                  /* Commit a file's changes to disk. */
 };
 
 #endif /* lib/syscall-nr.h */
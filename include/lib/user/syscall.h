@@ -13,6 +13,42 @@ typedef int pid_t;
 typedef int off_t;
 #define MAP_FAILED ((void *) NULL)
 
+/* Advice for madvise(). */
+#define MADV_NORMAL 0           /* No special treatment. */
+#define MADV_SEQUENTIAL 1       /* Read ahead aggressively, drop behind. */
+#define MADV_RANDOM 2           /* No readahead. */
+#define MADV_WILLNEED 3         /* Will be accessed soon; load now. */
+#define MADV_DONTNEED 4         /* Discard now. */
+#define MADV_FREE 5             /* Discard later unless written again. */
+#define MADV_HUGEPAGE 6         /* Back with 2 MB pages where possible. */
+
+/* Flags for msync(). */
+#define MS_ASYNC 1              /* Schedule writeback. */
+#define MS_INVALIDATE 2         /* Drop cached pages, to be reread. */
+#define MS_SYNC 4               /* Write back before returning. */
+
+/* Range of oom_score_adj(). */
+#define OOM_SCORE_ADJ_MIN (-1000)   /* Never chosen by the OOM killer. */
+#define OOM_SCORE_ADJ_MAX 1000      /* Chosen first. */
+
+/* Memory use reported by memstat(). */
+struct memstat {
+	/* The process, in pages. */
+	size_t rss_anon;        /* Resident anonymous pages. */
+	size_t rss_file;        /* Resident file-backed pages. */
+	size_t rss_shared;      /* Pages mapped to frames shared with others. */
+	size_t swapped;         /* Anonymous pages in swap. */
+	size_t peak_rss;        /* Most pages resident at once. */
+	size_t minor_faults;    /* Page faults served without I/O. */
+	size_t major_faults;    /* Page faults that read a file or swap. */
+	/* The whole system, in pages. */
+	size_t user_pages;      /* Size of the user pool. */
+	size_t user_free;       /* Free pages in the user pool. */
+	size_t frames;          /* Frames holding user pages. */
+	size_t swap_slots;      /* Size of the swap disk. */
+	size_t swap_used;       /* Swap slots in use. */
+};
+
 /* Maximum characters in a filename written by readdir(). */
 #define READDIR_MAX_LEN 14
 
@@ -41,6 +77,10 @@ int dup2(int oldfd, int newfd);
 /* Project 3 and optionally project 4. */
 void *mmap (void *addr, size_t length, int writable, int fd, off_t offset);
 void munmap (void *addr);
+int madvise (void *addr, size_t length, int advice);
+int msync (void *addr, size_t length, int flags);
+int memstat (pid_t pid, struct memstat *buf);
+int oom_score_adj (pid_t pid, int adj);
 
 /* Project 4 only. */
 bool chdir (const char *dir);
@@ -50,6 +90,9 @@ bool isdir (int fd);
 int inumber (int fd);
 int symlink (const char* target, const char* linkpath);
 
+/* File system extensions. */
+int fsync (int fd);
+
 static inline void* get_phys_addr (void *user_addr) {
 	void* pa;
 	asm volatile ("movq %0, %%rax" ::"r"(user_addr));
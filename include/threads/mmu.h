@@ -7,13 +7,22 @@
 
 typedef bool pte_for_each_func (uint64_t *pte, void *va, void *aux);
 
+/* Use PCIDs if the CPU has them.  Cleared by "-nopcid". */
+extern bool pcid_allowed;
+
 uint64_t *pml4e_walk (uint64_t *pml4, const uint64_t va, int create);
+uint64_t *pml4e_walk_pde (uint64_t *pml4, const uint64_t va, int create);
 uint64_t *pml4_create (void);
 bool pml4_for_each (uint64_t *, pte_for_each_func *, void *);
 void pml4_destroy (uint64_t *pml4);
 void pml4_activate (uint64_t *pml4);
+void pcid_init (void);
+unsigned pcid_alloc (void);
+void pcid_free (unsigned pcid);
+void pml4_print_stats (void);
 void *pml4_get_page (uint64_t *pml4, const void *upage);
 bool pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw);
+bool pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw);
 void pml4_clear_page (uint64_t *pml4, void *upage);
 bool pml4_is_dirty (uint64_t *pml4, const void *upage);
 void pml4_set_dirty (uint64_t *pml4, const void *upage, bool dirty);
@@ -114,6 +114,7 @@ struct thread {
 	struct lock *waiting_lock;			/* 이 스레드가 사용을 기다리고 있는 락 */
 	struct list donations;				
 	struct list_elem donations_elem;
+	int lock_cnt;                       /* Number of locks held. */
 
 	/* Advanced Scheduler */
 	int nice;
@@ -137,6 +138,11 @@ struct thread {
 	struct supplemental_page_table spt;
 	void *stack_bottom;
 	void *rsp_stack;
+	struct readahead ra[RA_STREAMS];    /* Most recently used first. */
+	size_t vm_counters[VMC_CNT];        /* Memory use; see vm_account(). */
+	int oom_score_adj;                  /* Added to the OOM badness, per mille. */
+	bool oom_killed;                    /* Chosen by the OOM killer. */
+	int64_t vtime;                      /* Ticks spent running. */
 #endif
 
 	/* Owned by thread.c. */
@@ -144,6 +150,10 @@ struct thread {
 	unsigned magic;                     /* Detects stack overflow. */
 
 	/* filesys */
+#ifdef FILESYS
+	int journal_depth;                  /* Nesting of journal_begin(). */
+	size_t journal_used;                /* Sectors logged by the operation. */
+#endif
 	struct file **fd_table;
 	int fd_idx;
 	struct file *running;
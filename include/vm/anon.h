@@ -10,5 +10,8 @@ struct anon_page {
 
 void vm_anon_init (void);
 bool anon_initializer (struct page *page, enum vm_type type, void *kva);
+void anon_share_slot (struct page *dst, struct page *src);
+void anon_swap_usage (size_t *slot_cnt, size_t *used_cnt);
+bool anon_swap_full (void);
 
 #endif
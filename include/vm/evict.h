@@ -0,0 +1,28 @@
+#ifndef VM_EVICT_H
+#define VM_EVICT_H
+#include <stdbool.h>
+
+struct frame;
+struct page;
+
+/* A page replacement policy.  Policies keep the frames of frame_table
+ * in lists of their own, threaded through frame->lru_elem.  Every
+ * callback runs with frame_table_lock held. */
+struct evict_policy {
+	const char *name;                   /* Name for "-evict=". */
+	void (*insert) (struct frame *);    /* FRAME joined frame_table. */
+	void (*remove) (struct frame *);    /* FRAME is leaving frame_table. */
+	struct frame *(*victim) (bool swap_full);   /* Next victim, or NULL. */
+};
+
+void evict_init (void);
+bool evict_set_policy (const char *name);
+void evict_insert (struct frame *frame);
+void evict_remove (struct frame *frame);
+struct frame *evict_victim (void);
+bool evict_frame_is_clean (const struct frame *frame);
+void evict_record (bool clean);
+void evict_refault (void);
+void evict_print_stats (void);
+
+#endif
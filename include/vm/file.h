@@ -4,8 +4,14 @@
 #include "vm/vm.h"
 
 struct page;
+struct supplemental_page_table;
 enum vm_type;
 
+/* Flags for msync().  Must match lib/user/syscall.h. */
+#define MS_ASYNC 1             /* Write back; done synchronously here. */
+#define MS_INVALIDATE 2        /* Also drop the pages, to be reread. */
+#define MS_SYNC 4              /* Write back before returning. */
+
 struct file_page {
 	struct file *file;
     off_t ofs;
@@ -15,7 +21,14 @@ struct file_page {
 
 void vm_file_init (void);
 bool file_backed_initializer (struct page *page, enum vm_type type, void *kva);
+bool file_backed_writeback (struct page *page);
+bool file_backed_writeback_pin (struct page *page);
+size_t file_backed_writeback_batch (struct page **pages, size_t cnt);
+void file_backed_sync (void *addr, size_t length);
+void file_backed_sync_all (struct supplemental_page_table *spt);
+void file_backed_print_stats (void);
 void *do_mmap(void *addr, size_t length, int writable,
 		struct file *file, off_t offset);
 void do_munmap (void *va);
+bool do_msync (void *addr, size_t length, int flags);
 #endif
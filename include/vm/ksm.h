@@ -0,0 +1,30 @@
+#ifndef VM_KSM_H
+#define VM_KSM_H
+#include <hash.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct frame;
+struct page;
+
+/* A frame holding contents found in several anonymous pages, mapped
+ * read-only by all of them.  A write gives the writer a private copy
+ * again. */
+struct ksm_node {
+	struct hash_elem elem;      /* Element in the stable map. */
+	uint64_t csum;              /* Hash of the contents. */
+	void *kva;                  /* The merged frame. */
+	int refs;                   /* Number of pages mapping it. */
+};
+
+/* Pages ksmd looks at every KSM_SLEEP_TICKS.  0, the default, leaves
+ * ksmd off.  Set with "-ksm=N". */
+extern unsigned ksm_pages_to_scan;
+
+void ksm_init (void);
+bool ksm_map (struct page *page, struct ksm_node *node);
+void ksm_put (struct ksm_node *node);
+void ksm_forget (struct frame *frame);
+void ksm_print_stats (void);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef VM_SHARE_H
+#define VM_SHARE_H
+#include <hash.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "filesys/off_t.h"
+
+struct file;
+struct inode;
+
+/* A frame holding one page of a file, shared read-only by every
+ * process that maps that page. */
+struct share_entry {
+	struct hash_elem elem;      /* Element in share_map. */
+	struct inode *inode;        /* File the page came from. */
+	off_t ofs;                  /* Offset of the page in the file. */
+	size_t read_bytes;          /* Bytes read; the rest is zeros. */
+	void *kva;                  /* The shared frame. */
+	int refs;                   /* Number of mappings. */
+	bool indexed;               /* Still findable in share_map. */
+	bool loading;               /* Being read in; KVA not yet set. */
+};
+
+void share_init (void);
+struct share_entry *share_get (struct file *file, off_t ofs,
+		size_t read_bytes);
+void share_put (struct share_entry *entry);
+void share_invalidate (struct inode *inode, off_t ofs, off_t size);
+void share_print_stats (void);
+
+#endif
@@ -4,8 +4,6 @@
 #include "threads/palloc.h"
 #include <hash.h>
 
-struct list swap_table;
-
 enum vm_type {
 	/* page not initialized */
 	VM_UNINIT = 0,
@@ -36,6 +34,19 @@ enum vm_type {
 
 struct page_operations;
 struct thread;
+struct share_entry;
+struct ksm_node;
+
+/* Advice for madvise().  Must match lib/user/syscall.h. */
+enum madvise_advice {
+	MADV_NORMAL,           /* No special treatment. */
+	MADV_SEQUENTIAL,       /* Read ahead aggressively, no second chance. */
+	MADV_RANDOM,           /* No readahead. */
+	MADV_WILLNEED,         /* Load the range now. */
+	MADV_DONTNEED,         /* Discard the range now. */
+	MADV_FREE,             /* Discard clean anonymous pages on demand. */
+	MADV_HUGEPAGE,         /* Back anonymous memory with 2 MB pages. */
+};
 
 #define VM_TYPE(type) ((type) & 7)
 
@@ -51,6 +62,13 @@ struct page {
 	/* Your implementation */
 	struct hash_elem hash_elem;
 	bool writable;
+	bool zero_mapped;      /* Mapped read-only to the shared zero frame. */
+	struct share_entry *shared;  /* Mapped read-only to a shared file frame. */
+	struct ksm_node *ksm;  /* Anonymous page merged by ksmd. */
+	uint8_t advice;        /* Access pattern from madvise(). */
+	bool lazy_free;        /* MADV_FREE: may be dropped while clean. */
+	bool hugepage;         /* MADV_HUGEPAGE: may share a 2 MB page. */
+	bool evicted;          /* Evicted and not faulted back in yet. */
 	int mapped_page_count;
 	/* Per-type data are binded into the union.
 	 * Each function automatically detects the current union */
@@ -68,14 +86,15 @@ struct page {
 struct frame {
 	void *kva;
 	struct page *page;
+	struct thread *thread;     /* Owner of the mapping. */
 	struct list_elem frame_elem;
-};
-
-struct slot {
-	bool is_full;
-	uint32_t slot_no;
-	struct list_elem swap_elem;
-	int dup_cnt;
+	struct list_elem lru_elem; /* Element in the replacement policy's lists. */
+	bool active;               /* On lru's active list. */
+	int64_t last_use;          /* Owner's vtime at last reference (wsclock). */
+	uint64_t ksm_csum;         /* Contents hash at ksmd's last visit. */
+	struct hash_elem ksm_elem; /* Element in ksmd's unstable map. */
+	bool ksm_unstable;         /* In ksmd's unstable map. */
+	bool pinned;               /* Being written back; not evicted or freed. */
 };
 
 /* The function table for page operations.
@@ -99,11 +118,62 @@ struct page_operations {
  * All designs up to you for this. */
 struct supplemental_page_table {
 	struct hash spt_hash;
+	struct list_elem mm_elem;   /* Element in the OOM killer's list. */
+};
+
+/* Readahead state of one stream of faults: a file mapping, keyed by
+ * its struct file (each mmap reopens the file), or swap, keyed by
+ * NULL.  Each thread tracks its RA_STREAMS most recent streams. */
+#define RA_STREAMS 4
+struct readahead {
+	void *key;             /* File, or NULL for swap. */
+	void *next_va;         /* First page past the last window. */
+	unsigned window;       /* Pages to load on the next fault; 0 if unused. */
+};
+
+/* Per-process memory counters, kept in struct thread and changed only
+ * through vm_account().  All but the fault counts are in pages. */
+enum vm_counter {
+	VMC_ANON,              /* Resident anonymous pages. */
+	VMC_FILE,              /* Resident file-backed pages. */
+	VMC_SHARED,            /* Pages mapped to shared file frames. */
+	VMC_SWAP,              /* Anonymous pages held in swap. */
+	VMC_PEAK_RSS,          /* Most of the three resident kinds at once. */
+	VMC_MINFLT,            /* Faults served without I/O. */
+	VMC_MAJFLT,            /* Faults that read a file or swap. */
+	VMC_CNT
+};
+
+/* Range of oom_score_adj().  Must match lib/user/syscall.h. */
+#define OOM_SCORE_ADJ_MIN (-1000)   /* Never chosen by the OOM killer. */
+#define OOM_SCORE_ADJ_MAX 1000
+
+/* Result of memstat().  Must match lib/user/syscall.h. */
+struct memstat {
+	/* The process, in pages. */
+	size_t rss_anon;
+	size_t rss_file;
+	size_t rss_shared;
+	size_t swapped;
+	size_t peak_rss;
+	size_t minor_faults;
+	size_t major_faults;
+	/* The whole system, in pages. */
+	size_t user_pages;
+	size_t user_free;
+	size_t frames;
+	size_t swap_slots;
+	size_t swap_used;
 };
 
 #include "threads/thread.h"
 #include "include/userprog/process.h"
 
+/* Serializes frame_table updates and page eviction. */
+extern struct list frame_table;
+extern struct lock frame_table_lock;
+extern unsigned fault_around_pages;
+
 void supplemental_page_table_init (struct supplemental_page_table *spt);
 bool supplemental_page_table_copy (struct supplemental_page_table *dst,
 		struct supplemental_page_table *src);
@@ -113,6 +183,7 @@ bool spt_insert_page (struct supplemental_page_table *spt, struct page *page);
 void spt_remove_page (struct supplemental_page_table *spt, struct page *page);
 
 void vm_init (void);
+void vm_print_stats (void);
 static void vm_stack_growth (void *addr UNUSED);
 bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
 		bool write, bool not_present);
@@ -122,7 +193,15 @@ bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
 bool vm_alloc_page_with_initializer (enum vm_type type, void *upage,
 		bool writable, vm_initializer *init, void *aux);
 void vm_dealloc_page (struct page *page);
+void vm_free_frame (struct page *page);
+void vm_frame_remove (struct frame *frame);
+void vm_frame_unpin (struct frame *frame);
+void vm_frame_wait_unpinned (struct page *page);
 bool vm_claim_page (void *va);
+bool vm_madvise (void *addr, size_t length, int advice);
+void vm_account (struct thread *t, enum vm_counter counter, int delta);
+void vm_memstat (struct thread *t, struct memstat *ms);
+void vm_oom_check (void);
 enum vm_type page_get_type (struct page *page);
 
 #endif  /* VM_VM_H */
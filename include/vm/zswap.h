@@ -0,0 +1,19 @@
+#ifndef VM_ZSWAP_H
+#define VM_ZSWAP_H
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Writes one page-sized buffer to a swap slot on disk. */
+typedef void zswap_writeback_func (size_t slot_no, const void *page);
+
+/* Percentage of the user pool the compressed pool may grow to.
+ * 0 disables the compressed tier.  Set with "-zswap=PCT". */
+extern unsigned zswap_max_pct;
+
+void zswap_init (zswap_writeback_func *writeback);
+bool zswap_store (size_t slot_no, const void *kva);
+bool zswap_load (size_t slot_no, void *kva);
+void zswap_invalidate (size_t slot_no);
+void zswap_print_stats (void);
+
+#endif
@@ -326,6 +326,21 @@ bitmap_write (const struct bitmap *b, struct file *file) {
 	off_t size = byte_cnt (b->bit_cnt);
 	return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the bytes of B holding the CNT bits starting at START to
+   the same place in FILE, which must already hold the rest of B.
+   Return true if successful, false otherwise. */
+bool
+bitmap_write_range (const struct bitmap *b, struct file *file,
+		size_t start, size_t cnt) {
+	ASSERT (start <= b->bit_cnt);
+	ASSERT (cnt <= b->bit_cnt - start);
+
+	off_t ofs = start / CHAR_BIT;
+	off_t size = byte_cnt (start + cnt) - ofs;
+	return file_write_at (file, (const char *) b->bits + ofs, size, ofs)
+		== size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
@@ -155,6 +155,26 @@ munmap (void *addr) {
 	syscall1 (SYS_MUNMAP, addr);
 }
 
+int
+madvise (void *addr, size_t length, int advice) {
+	return syscall3 (SYS_MADVISE, addr, length, advice);
+}
+
+int
+msync (void *addr, size_t length, int flags) {
+	return syscall3 (SYS_MSYNC, addr, length, flags);
+}
+
+int
+memstat (pid_t pid, struct memstat *buf) {
+	return syscall2 (SYS_MEMSTAT, pid, buf);
+}
+
+int
+oom_score_adj (pid_t pid, int adj) {
+	return syscall2 (SYS_OOM_SCORE_ADJ, pid, adj);
+}
+
 bool
 chdir (const char *dir) {
 	return syscall1 (SYS_CHDIR, dir);
@@ -194,3 +214,8 @@ int
 umount (const char *path) {
 	return syscall1 (SYS_UMOUNT, path);
 }
+
+int
+fsync (int fd) {
+	return syscall1 (SYS_FSYNC, fd);
+}
@@ -0,0 +1,42 @@
+/* Discards a page with madvise(MADV_DONTNEED) and then forks.  The
+   discarded page has neither a frame nor a swap slot, and must read
+   back as zeros in the child as well as in the parent. */
+
+#include <stdbool.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+
+static char buf[PAGE_SIZE * 2] __attribute__ ((aligned (PAGE_SIZE)));
+
+/* Returns true if the first page of buf is all zeros and the second
+   still holds what was written to it. */
+static bool
+check_buf (void)
+{
+  size_t i;
+
+  for (i = 0; i < PAGE_SIZE; i++)
+    if (buf[i] != 0 || buf[PAGE_SIZE + i] != 0x5a)
+      return false;
+  return true;
+}
+
+void
+test_main (void)
+{
+  pid_t child;
+
+  memset (buf, 0x5a, sizeof buf);
+  CHECK (madvise (buf, PAGE_SIZE, MADV_DONTNEED) == 0,
+         "madvise MADV_DONTNEED");
+
+  child = fork ("child");
+  if (child == 0)
+    exit (check_buf () ? 81 : 1);
+  CHECK (wait (child) == 81, "child sees a zeroed page");
+  CHECK (check_buf (), "parent sees a zeroed page");
+}
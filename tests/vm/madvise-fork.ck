@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(madvise-fork) begin
+(madvise-fork) madvise MADV_DONTNEED
+(madvise-fork) child sees a zeroed page
+(madvise-fork) parent sees a zeroed page
+(madvise-fork) end
+EOF
+pass;
@@ -31,11 +31,16 @@
 #include "tests/threads/tests.h"
 #ifdef VM
 #include "vm/vm.h"
+#include "vm/zswap.h"
+#include "vm/evict.h"
+#include "vm/ksm.h"
 #endif
 #ifdef FILESYS
 #include "devices/disk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/journal.h"
+#include "filesys/page_cache.h"
 #endif
 
 /* Page-map-level-4 with kernel mappings only. */
@@ -152,19 +157,33 @@ paging_init (uint64_t mem_end) {
 	extern char start, _end_kernel_text;
 	// Maps physical address [0 ~ mem_end] to
 	//   [LOADER_KERN_BASE ~ LOADER_KERN_BASE + mem_end].
-	for (uint64_t pa = 0; pa < mem_end; pa += PGSIZE) {
+	// Whole 2 MB chunks are mapped with 2 MB pages, except the first,
+	// which holds memory-mapped I/O, and those holding kernel text,
+	// which is mapped read-only page by page.
+	for (uint64_t pa = 0; pa < mem_end; ) {
 		uint64_t va = (uint64_t) ptov(pa);
 
 		perm = PTE_P | PTE_W;
+		if (pa != 0 && pa % HUGE_PGSIZE == 0 && pa + HUGE_PGSIZE <= mem_end
+				&& (va + HUGE_PGSIZE <= (uint64_t) &start
+					|| va >= (uint64_t) &_end_kernel_text)) {
+			if ((pte = pml4e_walk_pde (pml4, va, 1)) != NULL)
+				*pte = pa | perm | PTE_PS;
+			pa += HUGE_PGSIZE;
+			continue;
+		}
+
 		if ((uint64_t) &start <= va && va < (uint64_t) &_end_kernel_text)
 			perm &= ~PTE_W;
 
 		if ((pte = pml4e_walk (pml4, va, 1)) != NULL)
 			*pte = pa | perm;
+		pa += PGSIZE;
 	}
 
 	// reload cr3
 	pml4_activate(0);
+	pcid_init ();
 }
 
 /* Breaks the kernel command line into words and returns them as
@@ -221,11 +240,25 @@ parse_options (char **argv) {
 			random_init (atoi (value));
 		else if (!strcmp (name, "-mlfqs"))
 			thread_mlfqs = true;
+		else if (!strcmp (name, "-nopcid"))
+			pcid_allowed = false;
 #ifdef USERPROG
 		else if (!strcmp (name, "-ul"))
 			user_page_limit = atoi (value);
 		else if (!strcmp (name, "-threads-tests"))
 			thread_tests = true;
+#endif
+#ifdef VM
+		else if (!strcmp (name, "-zswap"))
+			zswap_max_pct = atoi (value);
+		else if (!strcmp (name, "-fa"))
+			fault_around_pages = atoi (value);
+		else if (!strcmp (name, "-ksm"))
+			ksm_pages_to_scan = atoi (value);
+		else if (!strcmp (name, "-evict")) {
+			if (value == NULL || !evict_set_policy (value))
+				PANIC ("unknown eviction policy `%s'", value);
+		}
 #endif
 		else
 			PANIC ("unknown option `%s' (use -h for help)", name);
@@ -326,8 +359,15 @@ usage (void) {
 			"  -f                 Format file system disk during startup.\n"
 			"  -rs=SEED           Set random number seed to SEED.\n"
 			"  -mlfqs             Use multi-level feedback queue scheduler.\n"
+			"  -nopcid            Flush the TLB on every address space switch.\n"
 #ifdef USERPROG
 			"  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+			"  -zswap=PCT         Cap compressed swap at PCT%% of user memory.\n"
+			"  -fa=N              Read ahead at most N pages per fault.\n"
+			"  -evict=POLICY      Replace pages with clock, wsclock or lru.\n"
+			"  -ksm=N             Merge equal pages, scanning N per 100 ms.\n"
 #endif
 			);
 	power_off ();
@@ -354,12 +394,18 @@ static void
 print_stats (void) {
 	timer_print_stats ();
 	thread_print_stats ();
+	pml4_print_stats ();
 #ifdef FILESYS
 	disk_print_stats ();
+	page_cache_print_stats ();
+	journal_print_stats ();
 #endif
 	console_print_stats ();
 	kbd_print_stats ();
 #ifdef USERPROG
 	exception_print_stats ();
 #endif
+#ifdef VM
+	vm_print_stats ();
+#endif
 }
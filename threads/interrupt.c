@@ -14,6 +14,9 @@
 #ifdef USERPROG
 #include "userprog/gdt.h"
 #endif
+#ifdef VM
+#include "vm/vm.h"
+#endif
 
 /* Number of x86_64 interrupts. */
 #define INTR_CNT 256
@@ -372,6 +375,13 @@ intr_handler (struct intr_frame *frame) {
 		if (yield_on_return)
 			thread_yield ();
 	}
+
+#ifdef VM
+	/* A process chosen by the OOM killer dies on its way back to
+	   user mode. */
+	if (frame->cs == SEL_UCSEG)
+		vm_oom_check ();
+#endif
 }
 
 /* Dumps interrupt frame F to the console, for debugging. */
@@ -1,19 +1,97 @@
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
 #include "threads/pte.h"
 #include "threads/palloc.h"
 #include "threads/thread.h"
 #include "threads/mmu.h"
+#include "threads/interrupt.h"
 #include "intrinsic.h"
 
+/* Process-context identifiers.  With CR4.PCIDE set, TLB entries are
+ * tagged with the PCID held in the low bits of CR3, so switching
+ * address spaces need not flush the TLB.  base_pml4, and any pml4
+ * that finds no free PCID, use PCID 0, which is flushed on every load.
+ * A user pml4 records its PCID in entry PCID_SLOT, the slot for the
+ * top 512 GB of the address space, which Pintos never maps; the
+ * entry's present bit stays clear, so the CPU ignores it. */
+#define CR4_PCIDE (1 << 17)
+#define CR3_NOFLUSH (1ULL << 63)
+#define CR3_PCID_MASK 0xfffULL
+#define CPUID_1_ECX_PCID (1 << 17)
+#define CPUID_7_EBX_INVPCID (1 << 10)
+#define INVPCID_ADDR 0              /* Invalidate one address. */
+#define PCID_CNT 4096
+#define PCID_SLOT (PGSIZE / sizeof (uint64_t) - 1)
+
+bool pcid_allowed = true;
+static bool pcid_enabled, invpcid_enabled;
+static bool pcid_used[PCID_CNT];
+static bool pcid_stale[PCID_CNT];   /* Must flush on next load. */
+static unsigned pcid_hint = 1;
+static long long cr3_flush_cnt, cr3_noflush_cnt;
+
+static long long huge_map_cnt, huge_split_cnt;
+
+/* Page tables set aside for splitting 2 MB pages, one for each 2 MB
+ * page still mapped, so that a split never fails.  Chained through
+ * their first word. */
+static void *split_reserve;
+
+static unsigned pml4_pcid (uint64_t *pml4);
+static void tlb_invalidate (uint64_t *pml4, const void *va);
+
+/* Sets aside a page table for splitting one more 2 MB page.  Returns
+ * false if none could be allocated. */
+static bool
+split_reserve_add (void) {
+	void **pt = palloc_get_page (0);
+	if (pt == NULL)
+		return false;
+
+	enum intr_level old_level = intr_disable ();
+	*pt = split_reserve;
+	split_reserve = pt;
+	intr_set_level (old_level);
+	return true;
+}
+
+/* Takes a page table set aside by split_reserve_add(). */
+static void *
+split_reserve_take (void) {
+	enum intr_level old_level = intr_disable ();
+	void **pt = split_reserve;
+	ASSERT (pt != NULL);
+	split_reserve = *pt;
+	intr_set_level (old_level);
+	return pt;
+}
+
+/* Replaces the 2 MB mapping in *PDE by a page table of 4 kB entries
+ * that map the same frames with the same flags.  The page table was
+ * set aside when the 2 MB page was mapped. */
+static void
+pde_split (uint64_t *pde) {
+	uint64_t *pt = split_reserve_take ();
+	uint64_t flags = *pde & PTE_FLAGS & ~PTE_PS;
+	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++)
+		pt[i] = (PTE_ADDR (*pde) + i * PGSIZE) | flags;
+	*pde = vtop (pt) | PTE_U | PTE_W | PTE_P;
+	huge_split_cnt++;
+}
+
+/* A 2 MB mapping met on the way is split, since the caller will
+ * read or change a single 4 kB entry. */
 static uint64_t *
 pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
 	int idx = PDX (va);
 	if (pdp) {
 		uint64_t *pte = (uint64_t *) pdp[idx];
-		if (!((uint64_t) pte & PTE_P)) {
+		if (((uint64_t) pte & PTE_P) && ((uint64_t) pte & PTE_PS)) {
+			pde_split (&pdp[idx]);
+		} else if (!((uint64_t) pte & PTE_P)) {
 			if (create) {
 				uint64_t *new_page = palloc_get_page (PAL_ZERO);
 				if (new_page)
@@ -88,6 +166,37 @@ pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 	return pte;
 }
 
+/* Returns the address of the page directory entry for virtual
+ * address VA in PML4, creating the tables above it if CREATE is
+ * true.  Returns a null pointer if they do not exist or cannot be
+ * allocated. */
+uint64_t *
+pml4e_walk_pde (uint64_t *pml4, const uint64_t va, int create) {
+	unsigned idx[2] = { PML4 (va), PDPE (va) };
+	uint64_t *table = pml4;
+
+	for (int level = 0; level < 2; level++) {
+		if (!(table[idx[level]] & PTE_P)) {
+			uint64_t *new_page = create ? palloc_get_page (PAL_ZERO) : NULL;
+			if (new_page == NULL)
+				return NULL;
+			table[idx[level]] = vtop (new_page) | PTE_U | PTE_W | PTE_P;
+		}
+		table = ptov (PTE_ADDR (table[idx[level]]));
+	}
+	return &table[PDX (va)];
+}
+
+/* Returns the page directory entry for VA in PML4 if VA lies in a
+ * 2 MB page, otherwise a null pointer.  Never splits. */
+static uint64_t *
+huge_pde (uint64_t *pml4, const void *va) {
+	uint64_t *pde = pml4e_walk_pde (pml4, (uint64_t) va, 0);
+	if (pde != NULL && (*pde & PTE_P) && (*pde & PTE_PS))
+		return pde;
+	return NULL;
+}
+
 /* Creates a new page map level 4 (pml4) has mappings for kernel
  * virtual addresses, but none for user virtual addresses.
  * Returns the new page directory, or a null pointer if memory
@@ -95,11 +204,103 @@ pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 uint64_t *
 pml4_create (void) {
 	uint64_t *pml4 = palloc_get_page (0);
-	if (pml4)
+	if (pml4) {
 		memcpy (pml4, base_pml4, PGSIZE);
+		pml4[PCID_SLOT] = (uint64_t) pcid_alloc () << 1;
+	}
 	return pml4;
 }
 
+/* Turns on PCIDs if the CPU has them and "-nopcid" was not given.
+ * Called with base_pml4 active. */
+void
+pcid_init (void) {
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid (1, 0, &eax, &ebx, &ecx, &edx);
+	if (!pcid_allowed || !(ecx & CPUID_1_ECX_PCID))
+		return;
+	cpuid (0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax >= 7) {
+		cpuid (7, 0, &eax, &ebx, &ecx, &edx);
+		invpcid_enabled = (ebx & CPUID_7_EBX_INVPCID) != 0;
+	}
+
+	ASSERT ((rcr3 () & CR3_PCID_MASK) == 0);
+	lcr4 (rcr4 () | CR4_PCIDE);
+	pcid_used[0] = true;
+	pcid_enabled = true;
+}
+
+/* Returns a free PCID, or 0 if none is free or PCIDs are off.  The
+ * TLB may still hold entries of the PCID's previous owner, so its
+ * first load flushes them. */
+unsigned
+pcid_alloc (void) {
+	unsigned pcid = 0;
+
+	if (!pcid_enabled)
+		return 0;
+
+	enum intr_level old_level = intr_disable ();
+	for (unsigned i = 0; i < PCID_CNT - 1; i++) {
+		unsigned cand = (pcid_hint + i) % (PCID_CNT - 1) + 1;
+		if (!pcid_used[cand]) {
+			pcid = cand;
+			pcid_used[pcid] = true;
+			pcid_stale[pcid] = true;
+			pcid_hint = pcid;
+			break;
+		}
+	}
+	intr_set_level (old_level);
+	return pcid;
+}
+
+/* Releases PCID. */
+void
+pcid_free (unsigned pcid) {
+	if (pcid != 0)
+		pcid_used[pcid] = false;
+}
+
+/* Prints address space switch and 2 MB page statistics. */
+void
+pml4_print_stats (void) {
+	printf ("TLB: %lld address space loads, %lld without flush%s\n",
+			cr3_flush_cnt + cr3_noflush_cnt, cr3_noflush_cnt,
+			pcid_enabled ? (invpcid_enabled ? " (PCID, INVPCID)" : " (PCID)") : "");
+	printf ("Huge pages: %lld user mappings, %lld split\n",
+			huge_map_cnt, huge_split_cnt);
+}
+
+/* Returns the PCID of PML4. */
+static unsigned
+pml4_pcid (uint64_t *pml4) {
+	if (pml4 == base_pml4)
+		return 0;
+	return (pml4[PCID_SLOT] >> 1) & CR3_PCID_MASK;
+}
+
+/* Removes any TLB entry for user page VA in PML4's address space.
+ * Only the active address space can use invlpg.  Another one is
+ * reached with invpcid, or else its PCID is flushed on its next
+ * load. */
+static void
+tlb_invalidate (uint64_t *pml4, const void *va) {
+	if ((rcr3 () & ~CR3_PCID_MASK) == vtop (pml4))
+		invlpg ((uint64_t) va);
+	else if (pcid_enabled) {
+		unsigned pcid = pml4_pcid (pml4);
+		if (pcid == 0)
+			return;
+		if (invpcid_enabled)
+			invpcid (INVPCID_ADDR, pcid, (uint64_t) va);
+		else
+			pcid_stale[pcid] = true;
+	}
+}
+
 static bool
 pt_for_each (uint64_t *pt, pte_for_each_func *func, void *aux,
 		unsigned pml4_index, unsigned pdp_index, unsigned pdx_index) {
@@ -122,7 +323,8 @@ pgdir_for_each (uint64_t *pdp, pte_for_each_func *func, void *aux,
 		unsigned pml4_index, unsigned pdp_index) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
+		/* 2 MB pages have no 4 kB entries to visit. */
+		if ((((uint64_t) pte) & PTE_P) && !(pdp[i] & PTE_PS))
 			if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
 					pml4_index, pdp_index, i))
 				return false;
@@ -169,8 +371,12 @@ static void
 pgdir_destroy (uint64_t *pdp) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
+		/* Frames behind a 2 MB page belong to the VM layer; only the
+		 * page table set aside for splitting it is freed. */
+		if ((((uint64_t) pte) & PTE_P) && !(pdp[i] & PTE_PS))
 			pt_destroy (PTE_ADDR (pte));
+		else if (pdp[i] & PTE_P)
+			palloc_free_page (split_reserve_take ());
 	}
 	palloc_free_page ((void *) pdp);
 }
@@ -196,14 +402,31 @@ pml4_destroy (uint64_t *pml4) {
 	uint64_t *pdpe = ptov ((uint64_t *) pml4[0]);
 	if (((uint64_t) pdpe) & PTE_P)
 		pdpe_destroy ((void *) PTE_ADDR (pdpe));
+	pcid_free (pml4_pcid (pml4));
 	palloc_free_page ((void *) pml4);
 }
 
 /* Loads page directory PD into the CPU's page directory base
- * register. */
+ * register.  With PCIDs, the TLB entries of PD's address space are
+ * kept unless they may be stale. */
 void
 pml4_activate (uint64_t *pml4) {
-	lcr3 (vtop (pml4 ? pml4 : base_pml4));
+	if (pml4 == NULL)
+		pml4 = base_pml4;
+
+	uint64_t cr3 = vtop (pml4);
+	if (pcid_enabled) {
+		unsigned pcid = pml4_pcid (pml4);
+		cr3 |= pcid;
+		if (pcid != 0 && !pcid_stale[pcid])
+			cr3 |= CR3_NOFLUSH;
+		pcid_stale[pcid] = false;
+	}
+	if (cr3 & CR3_NOFLUSH)
+		cr3_noflush_cnt++;
+	else
+		cr3_flush_cnt++;
+	lcr3 (cr3);
 }
 
 /* Looks up the physical address that corresponds to user virtual
@@ -214,6 +437,10 @@ void *
 pml4_get_page (uint64_t *pml4, const void *uaddr) {
 	ASSERT (is_user_vaddr (uaddr));
 
+	uint64_t *pde = huge_pde (pml4, uaddr);
+	if (pde != NULL)
+		return ptov (PTE_ADDR (*pde)) + ((uint64_t) uaddr & (HUGE_PGSIZE - 1));
+
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) uaddr, 0);
 
 	if (pte && (*pte & PTE_P))
@@ -238,11 +465,53 @@ pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) upage, 1);
 
-	if (pte)
+	if (pte) {
+		uint64_t old = *pte;
 		*pte = vtop (kpage) | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+		if (old & PTE_P)
+			tlb_invalidate (pml4, upage);
+	}
 	return pte != NULL;
 }
 
+/* Maps the HUGE_PGSIZE bytes at user virtual address UPAGE to the
+ * physically contiguous frames at KPAGE with one 2 MB page.  Both
+ * must be 2 MB aligned, and no 4 kB page in the range may be mapped.
+ * Returns true if successful, false if memory allocation failed.
+ * Any later change to a single page splits the mapping back into
+ * 4 kB pages, with a page table set aside here, so that the split
+ * cannot fail. */
+bool
+pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
+	ASSERT ((uint64_t) upage % HUGE_PGSIZE == 0);
+	ASSERT (vtop (kpage) % HUGE_PGSIZE == 0);
+	ASSERT (is_user_vaddr (upage));
+	ASSERT (pml4 != base_pml4);
+
+	if (!split_reserve_add ())
+		return false;
+	uint64_t *pde = pml4e_walk_pde (pml4, (uint64_t) upage, 1);
+	if (pde == NULL) {
+		palloc_free_page (split_reserve_take ());
+		return false;
+	}
+
+	uint64_t old = *pde;
+	*pde = vtop (kpage) | PTE_PS | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+	if (old & PTE_P) {
+		/* Drop the empty page table left by earlier 4 kB mappings,
+		 * once the TLB no longer caches it. */
+		uint64_t *pt = ptov (PTE_ADDR (old));
+		ASSERT (!(old & PTE_PS));
+		for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++)
+			ASSERT (!(pt[i] & PTE_P));
+		tlb_invalidate (pml4, upage);
+		palloc_free_page (pt);
+	}
+	huge_map_cnt++;
+	return true;
+}
+
 /* Marks user virtual page UPAGE "not present" in page
  * directory PD.  Later accesses to the page will fault.  Other
  * bits in the page table entry are preserved.
@@ -257,8 +526,7 @@ pml4_clear_page (uint64_t *pml4, void *upage) {
 
 	if (pte != NULL && (*pte & PTE_P) != 0) {
 		*pte &= ~PTE_P;
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) upage);
+		tlb_invalidate (pml4, upage);
 	}
 }
 
@@ -268,6 +536,10 @@ pml4_clear_page (uint64_t *pml4, void *upage) {
  * Returns false if PML4 contains no PTE for VPAGE. */
 bool
 pml4_is_dirty (uint64_t *pml4, const void *vpage) {
+	uint64_t *pde = huge_pde (pml4, vpage);
+	if (pde != NULL)
+		return (*pde & PTE_D) != 0;
+
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	return pte != NULL && (*pte & PTE_D) != 0;
 }
@@ -283,8 +555,7 @@ pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
 		else
 			*pte &= ~(uint32_t) PTE_D;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		tlb_invalidate (pml4, vpage);
 	}
 }
 
@@ -294,22 +565,28 @@ pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
  * PML4 contains no PTE for VPAGE. */
 bool
 pml4_is_accessed (uint64_t *pml4, const void *vpage) {
+	uint64_t *pde = huge_pde (pml4, vpage);
+	if (pde != NULL)
+		return (*pde & PTE_A) != 0;
+
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	return pte != NULL && (*pte & PTE_A) != 0;
 }
 
 /* Sets the accessed bit to ACCESSED in the PTE for virtual page
-   VPAGE in PD. */
+   VPAGE in PD.  Within a 2 MB page the bit is shared by all of its
+   4 kB pages, and is changed without splitting it. */
 void
 pml4_set_accessed (uint64_t *pml4, const void *vpage, bool accessed) {
-	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
+	uint64_t *pte = huge_pde (pml4, vpage);
+	if (pte == NULL)
+		pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	if (pte) {
 		if (accessed)
 			*pte |= PTE_A;
 		else
 			*pte &= ~(uint32_t) PTE_A;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		tlb_invalidate (pml4, vpage);
 	}
 }
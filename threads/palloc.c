@@ -31,6 +31,7 @@ struct pool {
 	struct lock lock;               /* Mutual exclusion. */
 	struct bitmap *used_map;        /* Bitmap of free pages. */
 	uint8_t *base;                  /* Base of pool. */
+	size_t free_cnt;                /* Number of free pages. */
 };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -232,6 +233,11 @@ split:
 			}
 		}
 	}
+
+	kernel_pool.free_cnt = bitmap_count (kernel_pool.used_map, 0,
+			bitmap_size (kernel_pool.used_map), false);
+	user_pool.free_cnt = bitmap_count (user_pool.used_map, 0,
+			bitmap_size (user_pool.used_map), false);
 }
 
 /* Initializes the page allocator and get the memory size */
@@ -265,6 +271,8 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 
 	lock_acquire (&pool->lock);
 	size_t page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+	if (page_idx != BITMAP_ERROR)
+		pool->free_cnt -= page_cnt;
 	lock_release (&pool->lock);
 	void *pages;
 
@@ -284,6 +292,36 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 	return pages;
 }
 
+/* Like palloc_get_multiple(), but the group starts at a physical
+   address that is a multiple of ALIGN pages, as a 2 MB page needs. */
+void *
+palloc_get_aligned (enum palloc_flags flags, size_t page_cnt, size_t align) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	size_t pool_cnt = bitmap_size (pool->used_map);
+	size_t first = (align - pg_no ((void *) vtop (pool->base)) % align) % align;
+	size_t page_idx = BITMAP_ERROR;
+	void *pages = NULL;
+
+	lock_acquire (&pool->lock);
+	for (size_t idx = first; idx + page_cnt <= pool_cnt; idx += align)
+		if (!bitmap_contains (pool->used_map, idx, page_cnt, true)) {
+			bitmap_set_multiple (pool->used_map, idx, page_cnt, true);
+			pool->free_cnt -= page_cnt;
+			page_idx = idx;
+			break;
+		}
+	lock_release (&pool->lock);
+
+	if (page_idx != BITMAP_ERROR) {
+		pages = pool->base + PGSIZE * page_idx;
+		if (flags & PAL_ZERO)
+			memset (pages, 0, PGSIZE * page_cnt);
+	} else if (flags & PAL_ASSERT)
+		PANIC ("palloc_get: out of pages");
+
+	return pages;
+}
+
 /* Obtains a single free page and returns its kernel virtual
    address.
    If PAL_USER is set, the page is obtained from the user pool,
@@ -320,6 +358,7 @@ palloc_free_multiple (void *pages, size_t page_cnt) {
 #endif
 	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
 	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	pool->free_cnt += page_cnt;
 }
 
 /* Frees the page at PAGE. */
@@ -328,6 +367,23 @@ palloc_free_page (void *page) {
 	palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of free pages in the user pool if PAL_USER is
+   set in FLAGS, otherwise in the kernel pool.  Frees are not
+   serialized with allocations, so treat this as a hint. */
+size_t
+palloc_free_cnt (enum palloc_flags flags) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	return pool->free_cnt;
+}
+
+/* Returns the total number of pages in the user pool if PAL_USER
+   is set in FLAGS, otherwise in the kernel pool. */
+size_t
+palloc_pool_size (enum palloc_flags flags) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	return bitmap_size (pool->used_map);
+}
+
 /* Initializes pool P as starting at START and ending at END */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
@@ -224,6 +224,7 @@ lock_acquire (struct lock *lock) {
    }
    //lock을 획득한 후 lock holder를 갱신한다.
    lock->holder = thread_current ();
+   lock->holder->lock_cnt++;
 }
 
 
@@ -241,8 +242,10 @@ lock_try_acquire (struct lock *lock) {
 	ASSERT (!lock_held_by_current_thread (lock));
 
 	success = sema_try_down (&lock->semaphore);
-	if (success)
+	if (success) {
 		lock->holder = thread_current ();
+		lock->holder->lock_cnt++;
+	}
 	return success;
 }
 
@@ -262,6 +265,7 @@ lock_release (struct lock *lock) {
       refresh_priority();
    }
 
+   lock->holder->lock_cnt--;
    lock->holder = NULL;
    sema_up (&lock->semaphore);
 }
@@ -151,6 +151,9 @@ thread_tick (void) {
 	struct thread *t = thread_current();
 
 	/* Update statistics. */
+#ifdef VM
+	t->vtime++;
+#endif
 	if (t == idle_thread)
 		idle_ticks++;
 #ifdef USERPROG
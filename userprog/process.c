@@ -170,6 +170,7 @@ __do_fork (void *aux) {
 	process_activate (current);
 #ifdef VM
 	supplemental_page_table_init (&current->spt);
+	current->oom_score_adj = parent->oom_score_adj;
 	if (!supplemental_page_table_copy (&current->spt, &parent->spt)){
 		goto error;
 	}
@@ -1,6 +1,7 @@
 #include <debug.h>
 #include "userprog/process.h"
 #include <stdio.h>
+#include <string.h>
 #include <syscall-nr.h>
 #include "threads/interrupt.h"
 #include "threads/thread.h"
@@ -10,6 +11,8 @@
 #include "intrinsic.h"
 #include "filesys/filesys.h"
 #include "filesys/file.h"
+#include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "vm/vm.h"
 
 #define MAX_FILE 128
@@ -33,10 +36,15 @@ int write (int fd, const void *buffer, unsigned length);
 void seek (int fd, unsigned position);
 unsigned tell (int fd);
 void close (int fd);
+int fsync (int fd);
 
 /* project 3 */
 void *mmap(void *addr, size_t length, int writable, int fd, off_t offset);
 void munmap(void *addr);
+int madvise(void *addr, size_t length, int advice);
+int msync(void *addr, size_t length, int flags);
+int memstat(tid_t pid, struct memstat *buf);
+int oom_score_adj(tid_t pid, int adj);
 
 
 /* System call.
@@ -280,6 +288,21 @@ void close (int fd) {
 	fdt[fd] = NULL;
 }
 
+/* Gives FD's delayed blocks their sectors, and waits for the journal
+ * to commit them along with FD's other changes. */
+int fsync (int fd) {
+	if (fd < 2) {
+		return -1;
+	}
+	struct file *f = get_file_from_fd_table(fd);
+	if (f == NULL) {
+		return -1;
+	}
+	inode_flush(file_get_inode(f));
+	journal_sync();
+	return 0;
+}
+
 void *mmap(void *addr, size_t length, int writable, int fd, off_t offset)
 {
     if (!addr || addr != pg_round_down(addr))
@@ -309,11 +332,70 @@ void munmap(void *addr) {
 	do_munmap(addr);
 }
 
+int madvise(void *addr, size_t length, int advice) {
+	if (addr != pg_round_down(addr) || !is_user_vaddr(addr)
+			|| !is_user_vaddr(addr + length) || addr + length < addr) {
+		return -1;
+	}
+	return vm_madvise(addr, length, advice) ? 0 : -1;
+}
+
+int msync(void *addr, size_t length, int flags) {
+	if (addr != pg_round_down(addr) || !is_user_vaddr(addr)
+			|| !is_user_vaddr(addr + length) || addr + length < addr) {
+		return -1;
+	}
+	return do_msync(addr, length, flags) ? 0 : -1;
+}
+
+/* Reports the memory use of PID, which must be the caller or one of
+ * its children, into BUF. */
+int memstat(tid_t pid, struct memstat *buf) {
+	struct memstat ms;
+	struct thread *t = thread_current();
+
+	validate_buffer(buf, sizeof *buf, true);
+	if (pid != t->tid) {
+		t = get_child_thread(pid);
+		if (t == NULL) {
+			return -1;
+		}
+	}
+	vm_memstat(t, &ms);
+	memcpy(buf, &ms, sizeof ms);
+	return 0;
+}
+
+/* Sets the OOM score adjustment of PID, which must be the caller or
+ * one of its children, to ADJ.  Only ADJ / 1000 of the system's
+ * memory is added to the process's badness, so OOM_SCORE_ADJ_MIN
+ * exempts it and OOM_SCORE_ADJ_MAX makes it the first choice. */
+int oom_score_adj(tid_t pid, int adj) {
+	struct thread *t = thread_current();
+
+	if (adj < OOM_SCORE_ADJ_MIN || adj > OOM_SCORE_ADJ_MAX) {
+		return -1;
+	}
+	if (pid != t->tid) {
+		t = get_child_thread(pid);
+		if (t == NULL) {
+			return -1;
+		}
+	}
+	#ifdef VM
+		t->oom_score_adj = adj;
+		return 0;
+	#else
+		return -1;
+	#endif
+}
+
 /* The main system call interface */
 void
 syscall_handler (struct intr_frame *f) {
 	#ifdef VM
 		thread_current()->rsp_stack = f->rsp;
+		vm_oom_check();
 	#endif
 	switch (f->R.rax) {
 		case SYS_HALT:
@@ -368,7 +450,25 @@ syscall_handler (struct intr_frame *f) {
 		case SYS_MUNMAP:
 			munmap(f->R.rdi);
 			break;
+		case SYS_MADVISE:
+			f->R.rax = madvise((void *) f->R.rdi, f->R.rsi, f->R.rdx);
+			break;
+		case SYS_MSYNC:
+			f->R.rax = msync((void *) f->R.rdi, f->R.rsi, f->R.rdx);
+			break;
+		case SYS_MEMSTAT:
+			f->R.rax = memstat(f->R.rdi, (struct memstat *) f->R.rsi);
+			break;
+		case SYS_OOM_SCORE_ADJ:
+			f->R.rax = oom_score_adj(f->R.rdi, f->R.rsi);
+			break;
+		case SYS_FSYNC:
+			f->R.rax = fsync(f->R.rdi);
+			break;
 		default:
 			exit(-1);
 	}
+	#ifdef VM
+		vm_oom_check();
+	#endif
 }
\ No newline at end of file
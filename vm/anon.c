@@ -1,7 +1,13 @@
 /* anon.c: Implementation of page for non-disk image (a.k.a. anonymous page). */
 
 #include "vm/vm.h"
+#include "vm/zswap.h"
+#include "vm/ksm.h"
 #include "devices/disk.h"
+#include <bitmap.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/mmu.h"
 
 /* DO NOT MODIFY BELOW LINE */
 static struct disk *swap_disk;
@@ -17,27 +23,45 @@ static const struct page_operations anon_ops = {
 	.type = VM_ANON,
 };
 
+/* Number of disk sectors in one swap slot. */
+#define SECTORS_PER_SLOT (PGSIZE / DISK_SECTOR_SIZE)
 
-//struct lock swap_table_lock;
+/* Swap table.  One bit per slot, set while the slot holds a page.
+ * slot_refs is indexed by slot_no and counts the anon pages that
+ * share the slot, so the slot is freed when the last one lets go.
+ * Freed slots are pushed on free_slots and slots never handed out yet
+ * start at swap_fresh, so allocation never scans the bitmap. */
+static struct bitmap *swap_table;
+static uint16_t *slot_refs;
+static uint32_t *free_slots;           /* Stack of freed slots. */
+static size_t free_top;                /* Entries on free_slots. */
+static size_t swap_fresh;              /* First slot never handed out. */
+static size_t swap_used;               /* Slots in use. */
+static struct lock swap_table_lock;
+
+static size_t swap_slot_alloc (void);
+static void swap_slot_put (size_t slot_no);
+static void swap_read_slot (size_t slot_no, void *page);
+static void swap_write_slot (size_t slot_no, const void *page);
 
 /* Initialize the data for anonymous pages */
 void
 vm_anon_init (void) {
 	/* TODO: Set up the swap_disk. */
 	swap_disk = disk_get(1, 1);
-	list_init(&swap_table);
-	//lock_init(&swap_table_lock);
-
-	disk_sector_t swap_size = disk_size(swap_disk)/8;
-	for (disk_sector_t i = 0; i < swap_size; i++) {
-		struct slot *slot = (struct slot *)malloc(sizeof(struct slot));
-		slot->is_full = false;
-		slot->slot_no = i;
-		slot->dup_cnt = 0;
-		//lock_acquire(&swap_table_lock);
-		list_push_back(&swap_table, &slot->swap_elem);
-		//lock_release(&swap_table_lock);
+	lock_init(&swap_table_lock);
+
+	size_t slot_cnt = swap_disk != NULL ? disk_size(swap_disk) / SECTORS_PER_SLOT : 0;
+	if (slot_cnt == 0) {
+		return;
+	}
+	swap_table = bitmap_create(slot_cnt);
+	slot_refs = calloc(slot_cnt, sizeof *slot_refs);
+	free_slots = malloc(slot_cnt * sizeof *free_slots);
+	if (swap_table == NULL || slot_refs == NULL || free_slots == NULL) {
+		PANIC("swap table creation failed");
 	}
+	zswap_init(swap_write_slot);
 }
 
 /* Initialize the file mapping */
@@ -51,33 +75,64 @@ anon_initializer (struct page *page, enum vm_type type, void *kva) {
 	return true;
 }
 
-/* Swap in the page by read contents from the swap disk. */
+/* Makes DST, a freshly initialized anon page, share the swap slot that
+ * SRC was swapped out to.  Used by fork so that a swapped-out parent
+ * page is not read back just to be copied. */
+void
+anon_share_slot (struct page *dst, struct page *src) {
+	ASSERT (src->anon.slot_no != -1);
+
+	lock_acquire(&swap_table_lock);
+	slot_refs[src->anon.slot_no]++;
+	lock_release(&swap_table_lock);
+	dst->anon.slot_no = src->anon.slot_no;
+	vm_account(thread_current(), VMC_SWAP, 1);
+}
+
+/* Reports the number of swap slots and how many of them are in use. */
+void
+anon_swap_usage (size_t *slot_cnt, size_t *used_cnt) {
+	*slot_cnt = *used_cnt = 0;
+	if (swap_table == NULL) {
+		return;
+	}
+	*slot_cnt = bitmap_size(swap_table);
+	*used_cnt = swap_used;
+}
+
+/* Returns true if there is no free swap slot left, so anonymous pages
+ * that need one cannot be swapped out. */
+bool
+anon_swap_full (void) {
+	return swap_table == NULL || swap_used == bitmap_size(swap_table);
+}
+
+/* Swap in the page by read contents from the swap disk.  A page merged
+ * by ksmd gets a private copy of the merged frame.  A page with no slot
+ * was discarded by madvise() and reads back as zeros. */
 static bool
 anon_swap_in (struct page *page, void *kva) {
 	struct anon_page *anon_page = &page->anon;
-	disk_sector_t page_slot_no = anon_page->slot_no;
-	struct list_elem *e;
-	struct slot *slot;
-	//lock_acquire(&swap_table_lock);
-	for (e = list_begin(&swap_table); e != list_end(&swap_table); e = list_next(e)) {
-		slot = list_entry(e, struct slot, swap_elem);
-		if (slot->slot_no == page_slot_no) {
-			for (int i = 0; i < 8; i++) {
-				disk_read(swap_disk, page_slot_no*8 + i, kva + DISK_SECTOR_SIZE*i);
-			}
-			if(slot->dup_cnt > 0){
-				slot->dup_cnt--;
-			}
-			else{
-				slot->is_full = false;
-			}
-			anon_page->slot_no = -1;
-			//lock_release(&swap_table_lock);
-			return true;
-		}
+	if (page->ksm != NULL) {
+		memcpy(kva, page->ksm->kva, PGSIZE);
+		ksm_put(page->ksm);
+		page->ksm = NULL;
+		vm_account(page->frame->thread, VMC_SHARED, -1);
+		return true;
+	}
+	if (anon_page->slot_no == -1) {
+		memset(kva, 0, PGSIZE);
+		return true;
+	}
+
+	size_t slot_no = anon_page->slot_no;
+	if (!zswap_load(slot_no, kva)) {
+		swap_read_slot(slot_no, kva);
 	}
-	//lock_release(&swap_table_lock);
-	return false;
+	swap_slot_put(slot_no);
+	anon_page->slot_no = -1;
+	vm_account(page->frame->thread, VMC_SWAP, -1);
+	return true;
 }
 
 /* Swap out the page by writing contents to the swap disk. */
@@ -87,44 +142,118 @@ anon_swap_out (struct page *page) {
 		return false;
 	}
 	struct anon_page *anon_page = &page->anon;
-	struct list_elem *e;
-	struct slot *slot;
-	//lock_acquire(&swap_table_lock);
-
-	for (e = list_begin(&swap_table); e != list_end(&swap_table); e = list_next(e)) {
-		slot = list_entry(e, struct slot, swap_elem);
-		if (!slot->is_full) {
-			for (int i = 0; i < 8; i++) {
-				disk_write(swap_disk, slot->slot_no*8 + i, page->va + DISK_SECTOR_SIZE*i);
-			}
-			anon_page->slot_no = slot->slot_no;
-			slot->is_full = true;
-			page->frame->page = NULL;
-			page->frame = NULL;
-			pml4_clear_page(thread_current()->pml4, page->va);
-			//lock_release(&swap_table_lock);
-			return true;
+	uint64_t *pml4 = page->frame->thread->pml4;
+
+	/* Unmap first, so the owner cannot dirty the page mid-write. */
+	pml4_clear_page(pml4, page->va);
+	bool dirty = pml4_is_dirty(pml4, page->va);
+	if (page->lazy_free && !dirty) {
+		/* Freed by madvise() and not written since: drop it. */
+		page->lazy_free = false;
+		page->frame->page = NULL;
+		page->frame = NULL;
+		return true;
+	}
+
+	size_t slot_no = swap_slot_alloc();
+	if (slot_no == BITMAP_ERROR) {
+		/* Swap is full.  Put the page back and let the caller find
+		 * another victim or fall back to the OOM killer. */
+		if (!pml4_set_page(pml4, page->va, page->frame->kva, page->writable)) {
+			PANIC("cannot remap page");
 		}
+		pml4_set_dirty(pml4, page->va, dirty);
+		return false;
 	}
-	//lock_release(&swap_table_lock);
-	PANIC("insufficient swap space");
+	page->lazy_free = false;
+
+	if (!zswap_store(slot_no, page->frame->kva)) {
+		swap_write_slot(slot_no, page->frame->kva);
+	}
+	anon_page->slot_no = slot_no;
+	vm_account(page->frame->thread, VMC_SWAP, 1);
+	page->frame->page = NULL;
+	page->frame = NULL;
+	return true;
 }
 
-/* Destroy the anonymous page. PAGE will be freed by the caller. */
+/* Destroy the anonymous page. PAGE will be freed by the caller.
+ * madvise() also uses this to discard the contents of a page that
+ * stays in use. */
 static void
 anon_destroy (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
-	struct list_elem *e;
-	struct slot *slot;
-
-	//lock_acquire(&swap_table_lock);
-	for (e = list_begin(&swap_table); e != list_end(&swap_table); e = list_next(e)) {
-		slot = list_entry(e, struct slot, swap_elem);
-		if (slot->slot_no == anon_page->slot_no) {
-			slot->is_full = false;
-			break;
-		}
+
+	vm_free_frame(page);
+	if (page->ksm != NULL) {
+		pml4_clear_page(thread_current()->pml4, page->va);
+		ksm_put(page->ksm);
+		page->ksm = NULL;
+		vm_account(thread_current(), VMC_SHARED, -1);
+	}
+	if (anon_page->slot_no != -1) {
+		swap_slot_put(anon_page->slot_no);
+		anon_page->slot_no = -1;
+		vm_account(thread_current(), VMC_SWAP, -1);
+	}
+	page->lazy_free = false;
+}
+
+/* Claims a free swap slot and returns its number, or BITMAP_ERROR if
+ * the swap disk is full.  The most recently freed slot is reused
+ * first; otherwise the next slot never used is taken. */
+static size_t
+swap_slot_alloc (void) {
+	size_t slot_no = BITMAP_ERROR;
+
+	if (swap_table == NULL) {
+		return BITMAP_ERROR;
+	}
+
+	lock_acquire(&swap_table_lock);
+	if (free_top > 0) {
+		slot_no = free_slots[--free_top];
+	} else if (swap_fresh < bitmap_size(swap_table)) {
+		slot_no = swap_fresh++;
+	}
+	if (slot_no != BITMAP_ERROR) {
+		ASSERT (!bitmap_test(swap_table, slot_no));
+		bitmap_mark(swap_table, slot_no);
+		slot_refs[slot_no] = 1;
+		swap_used++;
+	}
+	lock_release(&swap_table_lock);
+	return slot_no;
+}
+
+/* Drops one reference to SLOT_NO and frees the slot with the last one. */
+static void
+swap_slot_put (size_t slot_no) {
+	lock_acquire(&swap_table_lock);
+	ASSERT (bitmap_test(swap_table, slot_no));
+	ASSERT (slot_refs[slot_no] > 0);
+	if (--slot_refs[slot_no] == 0) {
+		/* Drop the compressed copy before the slot can be reused. */
+		zswap_invalidate(slot_no);
+		bitmap_reset(swap_table, slot_no);
+		swap_used--;
+		free_slots[free_top++] = slot_no;
+	}
+	lock_release(&swap_table_lock);
+}
+
+/* Reads swap slot SLOT_NO from the swap disk into PAGE. */
+static void
+swap_read_slot (size_t slot_no, void *page) {
+	for (int i = 0; i < SECTORS_PER_SLOT; i++) {
+		disk_read(swap_disk, slot_no * SECTORS_PER_SLOT + i, page + DISK_SECTOR_SIZE * i);
 	}
-	//lock_release(&swap_table_lock);
 }
 
+/* Writes PAGE to swap slot SLOT_NO on the swap disk. */
+static void
+swap_write_slot (size_t slot_no, const void *page) {
+	for (int i = 0; i < SECTORS_PER_SLOT; i++) {
+		disk_write(swap_disk, slot_no * SECTORS_PER_SLOT + i, page + DISK_SECTOR_SIZE * i);
+	}
+}
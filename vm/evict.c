@@ -0,0 +1,312 @@
+/* evict.c: Page replacement policies.
+ *
+ * The policy used to pick eviction victims is chosen with "-evict=":
+ *
+ *   clock    Second-chance clock.  One referenced bit per frame.
+ *
+ *   wsclock  WSClock.  A frame whose page has not been referenced for
+ *            WS_TAU ticks of its owner's CPU time has left the owner's
+ *            working set.  Clean pages out of the working set are taken
+ *            first, then dirty ones, then anything unreferenced.
+ *
+ *   lru      Active and inactive lists, as in Linux.  Frames start on
+ *            the inactive list and move to the active list when found
+ *            referenced there; the active list is aged into the inactive
+ *            one so that it never grows longer.  Victims come from the
+ *            head of the inactive list, clean pages first.
+ *
+ * Pages advised MADV_SEQUENTIAL, and clean MADV_FREE pages, never count
+ * as referenced.  Frames whose page is still being loaded or is pinned
+ * for writeback, and anonymous pages that would need a swap slot while
+ * swap is full, are never chosen. */
+
+#include "vm/evict.h"
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/mmu.h"
+#include "threads/synch.h"
+#include "vm/vm.h"
+
+/* Working-set window of wsclock, in ticks of the owner's CPU time. */
+#define WS_TAU 50
+
+static const struct evict_policy clock_policy, wsclock_policy, lru_policy;
+static const struct evict_policy *policies[] = {
+	&clock_policy, &wsclock_policy, &lru_policy,
+};
+static const struct evict_policy *policy = &clock_policy;
+
+/* Statistics.  An eviction is a hit unless the page is faulted back in
+ * later, which is a refault. */
+static long long evict_cnt, clean_cnt, refault_cnt;
+
+static bool frame_evictable (const struct frame *frame, bool swap_full);
+static bool frame_referenced (const struct frame *frame);
+
+/* Ring of every frame, used by clock and wsclock, and its hand. */
+static struct list ring;
+static struct list_elem *hand;
+static size_t ring_cnt;
+
+/* Lists of lru. */
+static struct list active, inactive;
+static size_t active_cnt, inactive_cnt;
+
+void
+evict_init (void) {
+	list_init (&ring);
+	hand = list_end (&ring);
+	list_init (&active);
+	list_init (&inactive);
+}
+
+/* Selects the policy called NAME.  Returns false if there is none. */
+bool
+evict_set_policy (const char *name) {
+	for (size_t i = 0; i < sizeof policies / sizeof *policies; i++)
+		if (!strcmp (name, policies[i]->name)) {
+			policy = policies[i];
+			return true;
+		}
+	return false;
+}
+
+void
+evict_insert (struct frame *frame) {
+	ASSERT (lock_held_by_current_thread (&frame_table_lock));
+	policy->insert (frame);
+}
+
+void
+evict_remove (struct frame *frame) {
+	ASSERT (lock_held_by_current_thread (&frame_table_lock));
+	policy->remove (frame);
+}
+
+/* Returns the frame to evict next, or NULL if no frame can be
+ * evicted. */
+struct frame *
+evict_victim (void) {
+	ASSERT (lock_held_by_current_thread (&frame_table_lock));
+	return policy->victim (anon_swap_full ());
+}
+
+/* Returns true if the page in FRAME can be evicted without a disk
+ * write: an unmodified file page or an unmodified MADV_FREE page. */
+bool
+evict_frame_is_clean (const struct frame *frame) {
+	struct page *page = frame->page;
+	uint64_t *pml4 = frame->thread->pml4;
+
+	if (pml4_is_dirty (pml4, page->va))
+		return false;
+	return page_get_type (page) == VM_FILE || page->lazy_free;
+}
+
+/* Counts one eviction, of a clean page if CLEAN. */
+void
+evict_record (bool clean) {
+	evict_cnt++;
+	if (clean)
+		clean_cnt++;
+}
+
+/* Counts a fault on a page that was evicted. */
+void
+evict_refault (void) {
+	refault_cnt++;
+}
+
+/* Prints replacement statistics. */
+void
+evict_print_stats (void) {
+	long long hit_cnt = evict_cnt > refault_cnt ? evict_cnt - refault_cnt : 0;
+	printf ("Eviction: %s, %lld evictions (%lld clean), %lld refaults, "
+			"%lld%% hits\n", policy->name, evict_cnt, clean_cnt, refault_cnt,
+			evict_cnt ? hit_cnt * 100 / evict_cnt : 0);
+}
+
+/* Returns true if FRAME holds a page that may be evicted. */
+static bool
+frame_evictable (const struct frame *frame, bool swap_full) {
+	if (frame->page == NULL || frame->pinned)
+		return false;
+	return !swap_full || page_get_type (frame->page) != VM_ANON
+		|| evict_frame_is_clean (frame);
+}
+
+/* Returns whether FRAME's page was referenced since the last call, and
+ * clears its accessed bit. */
+static bool
+frame_referenced (const struct frame *frame) {
+	struct page *page = frame->page;
+	uint64_t *pml4 = frame->thread->pml4;
+
+	if (page->advice == MADV_SEQUENTIAL
+			|| (page->lazy_free && !pml4_is_dirty (pml4, page->va))
+			|| !pml4_is_accessed (pml4, page->va))
+		return false;
+	pml4_set_accessed (pml4, page->va, false);
+	return true;
+}
+
+/* Ring shared by clock and wsclock. */
+
+static void
+ring_insert (struct frame *frame) {
+	frame->last_use = 0;
+	list_push_back (&ring, &frame->lru_elem);
+	ring_cnt++;
+}
+
+static void
+ring_remove (struct frame *frame) {
+	if (hand == &frame->lru_elem)
+		hand = list_next (hand);
+	list_remove (&frame->lru_elem);
+	ring_cnt--;
+}
+
+/* Returns the frame under the hand and advances the hand. */
+static struct frame *
+ring_advance (void) {
+	if (hand == list_end (&ring))
+		hand = list_begin (&ring);
+	struct frame *frame = list_entry (hand, struct frame, lru_elem);
+	hand = list_next (hand);
+	return frame;
+}
+
+/* Second-chance clock. */
+static struct frame *
+clock_victim (bool swap_full) {
+	for (size_t i = 0; i < 2 * ring_cnt; i++) {
+		struct frame *frame = ring_advance ();
+		if (frame_evictable (frame, swap_full) && !frame_referenced (frame))
+			return frame;
+	}
+	return NULL;
+}
+
+static const struct evict_policy clock_policy = {
+	.name = "clock",
+	.insert = ring_insert,
+	.remove = ring_remove,
+	.victim = clock_victim,
+};
+
+/* WSClock.  The sweep stops at the first clean page outside its
+ * owner's working set; failing that, it takes the first dirty one, and
+ * failing that, the first page found unreferenced. */
+static struct frame *
+wsclock_victim (bool swap_full) {
+	struct frame *dirty = NULL, *unreferenced = NULL;
+
+	for (size_t i = 0; i < 2 * ring_cnt; i++) {
+		struct frame *frame = ring_advance ();
+		if (!frame_evictable (frame, swap_full))
+			continue;
+
+		int64_t vtime = frame->thread->vtime;
+		if (frame_referenced (frame)) {
+			frame->last_use = vtime;
+			continue;
+		}
+		if (unreferenced == NULL)
+			unreferenced = frame;
+		if (vtime - frame->last_use <= WS_TAU)
+			continue;
+		if (evict_frame_is_clean (frame))
+			return frame;
+		if (dirty == NULL)
+			dirty = frame;
+	}
+	return dirty != NULL ? dirty : unreferenced;
+}
+
+static const struct evict_policy wsclock_policy = {
+	.name = "wsclock",
+	.insert = ring_insert,
+	.remove = ring_remove,
+	.victim = wsclock_victim,
+};
+
+/* Active and inactive lists. */
+
+static void
+lru_insert (struct frame *frame) {
+	frame->active = false;
+	list_push_back (&inactive, &frame->lru_elem);
+	inactive_cnt++;
+}
+
+static void
+lru_remove (struct frame *frame) {
+	list_remove (&frame->lru_elem);
+	if (frame->active)
+		active_cnt--;
+	else
+		inactive_cnt--;
+}
+
+/* Moves FRAME to the tail of the active list if ACTIVATE, otherwise
+ * to the tail of the inactive list. */
+static void
+lru_move (struct frame *frame, bool activate) {
+	lru_remove (frame);
+	frame->active = activate;
+	list_push_back (activate ? &active : &inactive, &frame->lru_elem);
+	if (activate)
+		active_cnt++;
+	else
+		inactive_cnt++;
+}
+
+/* Ages the active list until it is no longer than the inactive one:
+ * frames at its head that were referenced go round again, the others
+ * are deactivated. */
+static void
+lru_shrink_active (void) {
+	for (size_t n = active_cnt; n > 0 && active_cnt > inactive_cnt; n--) {
+		struct frame *frame = list_entry (list_front (&active),
+				struct frame, lru_elem);
+		lru_move (frame, frame->page != NULL && frame_referenced (frame));
+	}
+}
+
+static struct frame *
+lru_victim (bool swap_full) {
+	for (int pass = 0; pass < 2; pass++) {
+		struct frame *dirty = NULL;
+
+		lru_shrink_active ();
+		for (size_t n = inactive_cnt; n > 0; n--) {
+			struct frame *frame = list_entry (list_front (&inactive),
+					struct frame, lru_elem);
+			if (!frame_evictable (frame, swap_full)) {
+				lru_move (frame, false);
+				continue;
+			}
+			if (frame_referenced (frame)) {
+				lru_move (frame, true);
+				continue;
+			}
+			if (evict_frame_is_clean (frame))
+				return frame;
+			if (dirty == NULL)
+				dirty = frame;
+			lru_move (frame, false);
+		}
+		if (dirty != NULL)
+			return dirty;
+	}
+	return NULL;
+}
+
+static const struct evict_policy lru_policy = {
+	.name = "lru",
+	.insert = lru_insert,
+	.remove = lru_remove,
+	.victim = lru_victim,
+};
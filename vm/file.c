@@ -3,11 +3,20 @@
 #include "vm/vm.h"
 #include "threads/vaddr.h"
 #include "userprog/process.h"
+#include "threads/mmu.h"
+#include "threads/malloc.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <round.h>
 
 static bool file_backed_swap_in (struct page *page, void *kva);
 static bool file_backed_swap_out (struct page *page);
 static void file_backed_destroy (struct page *page);
+static int writeback_cmp (const void *a_, const void *b_);
+static void file_backed_sync_pages (struct page **pages, size_t cnt);
+
+/* Pages written back in batches, and the sequential runs they made. */
+static long long wb_page_cnt, wb_run_cnt;
 
 /* DO NOT MODIFY this struct */
 static const struct page_operations file_ops = {
@@ -44,33 +53,182 @@ file_backed_swap_in (struct page *page, void *kva) {
 	return lazy_load_segment(page, file_page);
 }
 
+/* Writes PAGE back to its file if it is resident and dirty, then
+ * marks it clean.  Returns true if anything was written. */
+bool
+file_backed_writeback (struct page *page) {
+	struct file_page *file_page = &page->file;
+	if (page->frame == NULL) {
+		return false;
+	}
+
+	uint64_t *pml4 = page->frame->thread->pml4;
+	if (!pml4_is_dirty(pml4, page->va)) {
+		return false;
+	}
+	pml4_set_dirty(pml4, page->va, 0);
+	file_write_at(file_page->file, page->frame->kva, file_page->page_read_bytes, file_page->ofs);
+	return true;
+}
+
+/* Orders pages by file, then by offset. */
+static int
+writeback_cmp (const void *a_, const void *b_) {
+	const struct page *a = *(struct page *const *) a_;
+	const struct page *b = *(struct page *const *) b_;
+	struct inode *a_inode = file_get_inode(a->file.file);
+	struct inode *b_inode = file_get_inode(b->file.file);
+
+	if (a_inode != b_inode) {
+		return a_inode < b_inode ? -1 : 1;
+	}
+	return a->file.ofs < b->file.ofs ? -1 : a->file.ofs > b->file.ofs;
+}
+
+/* If PAGE is resident and dirty, marks it clean and pins its frame,
+ * so that it can be written back without frame_table_lock: the frame
+ * is neither evicted nor freed until it is unpinned.  A write to the
+ * page from here on dirties it again.  Returns true if PAGE was
+ * pinned.  Caller holds frame_table_lock. */
+bool
+file_backed_writeback_pin (struct page *page) {
+	ASSERT (lock_held_by_current_thread(&frame_table_lock));
+	if (page->frame == NULL || page->frame->pinned) {
+		return false;
+	}
+
+	uint64_t *pml4 = page->frame->thread->pml4;
+	if (!pml4_is_dirty(pml4, page->va)) {
+		return false;
+	}
+	pml4_set_dirty(pml4, page->va, 0);
+	page->frame->pinned = true;
+	return true;
+}
+
+/* Writes back the CNT file-backed PAGES, pinned by
+ * file_backed_writeback_pin(), sorted by file and offset so that pages
+ * next to each other in a file reach the disk as one sequential run
+ * instead of in clock or hash order, and unpins them.  Caller does not
+ * hold frame_table_lock.  Returns the number written. */
+size_t
+file_backed_writeback_batch (struct page **pages, size_t cnt) {
+	const struct page *prev = NULL;
+
+	qsort(pages, cnt, sizeof *pages, writeback_cmp);
+	for (size_t i = 0; i < cnt; i++) {
+		struct page *page = pages[i];
+		struct file_page *file_page = &page->file;
+
+		ASSERT (page->frame != NULL && page->frame->pinned);
+		file_write_at(file_page->file, page->frame->kva,
+				file_page->page_read_bytes, file_page->ofs);
+		if (prev == NULL
+				|| file_get_inode(prev->file.file) != file_get_inode(page->file.file)
+				|| prev->file.ofs + PGSIZE != page->file.ofs) {
+			wb_run_cnt++;
+		}
+		prev = page;
+		vm_frame_unpin(page->frame);
+	}
+	wb_page_cnt += cnt;
+	return cnt;
+}
+
+/* Writes back the dirty resident file-backed pages among the CNT PAGES
+ * of the current process as one batch.  A page kswapd is writing is
+ * waited for, since it may have been dirtied again meanwhile. */
+static void
+file_backed_sync_pages (struct page **pages, size_t cnt) {
+	size_t dirty = 0;
+
+	lock_acquire(&frame_table_lock);
+	for (size_t i = 0; i < cnt; i++) {
+		if (page_get_type(pages[i]) != VM_FILE) {
+			continue;
+		}
+		vm_frame_wait_unpinned(pages[i]);
+		if (file_backed_writeback_pin(pages[i])) {
+			pages[dirty++] = pages[i];
+		}
+	}
+	lock_release(&frame_table_lock);
+	file_backed_writeback_batch(pages, dirty);
+}
+
+/* Writes back the current process's dirty file-backed pages in
+ * [ADDR, ADDR + LENGTH).  Used by msync() and munmap(). */
+void
+file_backed_sync (void *addr, size_t length) {
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	size_t page_cnt = DIV_ROUND_UP(length, PGSIZE);
+	struct page **pages = malloc(page_cnt * sizeof *pages);
+	size_t cnt = 0;
+
+	if (pages == NULL) {
+		/* Each page is still written back when it is destroyed. */
+		return;
+	}
+	for (size_t i = 0; i < page_cnt; i++) {
+		struct page *page = spt_find_page(spt, addr + i * PGSIZE);
+		if (page != NULL) {
+			pages[cnt++] = page;
+		}
+	}
+	file_backed_sync_pages(pages, cnt);
+	free(pages);
+}
+
+/* Writes back every dirty file-backed page in SPT, which belongs to
+ * the current process.  Used at exit, before the pages are torn down
+ * in hash order. */
+void
+file_backed_sync_all (struct supplemental_page_table *spt) {
+	struct page **pages = malloc(hash_size(&spt->spt_hash) * sizeof *pages);
+	struct hash_iterator i;
+	size_t cnt = 0;
+
+	if (pages == NULL) {
+		return;
+	}
+	hash_first(&i, &spt->spt_hash);
+	while (hash_next(&i)) {
+		pages[cnt++] = hash_entry(hash_cur(&i), struct page, hash_elem);
+	}
+	file_backed_sync_pages(pages, cnt);
+	free(pages);
+}
+
+/* Prints batched writeback statistics. */
+void
+file_backed_print_stats (void) {
+	printf("Writeback: %lld pages in %lld sequential runs\n",
+			wb_page_cnt, wb_run_cnt);
+}
+
 /* Swap out the page by writeback contents to the file. */
 static bool
 file_backed_swap_out (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
-	if (pml4_is_dirty(thread_current()->pml4, page->va))
-	{
-		file_write_at(file_page->file, page->va, file_page->page_read_bytes, file_page->ofs);
-		pml4_set_dirty(thread_current()->pml4, page->va, 0);
-	}
-
+	file_backed_writeback(page);
 
+	pml4_clear_page(page->frame->thread->pml4, page->va);
 	page->frame->page = NULL;
 	page->frame = NULL;
-	pml4_clear_page(thread_current()->pml4, page->va);
 	return true;
 }
 
-/* Destory the file backed page. PAGE will be freed by the caller. */
+/* Destory the file backed page. PAGE will be freed by the caller.
+ * A dirty page is pinned and written back without frame_table_lock. */
 static void
 file_backed_destroy (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
-	if (pml4_is_dirty(thread_current()->pml4, page->va)) {
-		file_write_at(file_page->file, page->va, file_page->page_read_bytes, file_page->ofs);
-		pml4_set_dirty(thread_current()->pml4, page->va, 0);
+	lock_acquire(&frame_table_lock);
+	vm_frame_wait_unpinned(page);
+	bool dirty = file_backed_writeback_pin(page);
+	lock_release(&frame_table_lock);
+	if (dirty) {
+		file_backed_writeback_batch(&page, 1);
 	}
-	pml4_clear_page(thread_current()->pml4, page->va);
-	list_remove(&page->frame->frame_elem);
+	vm_free_frame(page);
 }
 
 /* Do the mmap */
@@ -129,11 +287,41 @@ do_munmap (void *addr) {
 	struct page *p = spt_find_page(spt, addr);
 	int count = p->mapped_page_count;
 
+	file_backed_sync(addr, count * PGSIZE);
 	for (int i = 0; i < count; i++) {
 		if (p) {
-			destroy(p);
+			spt_remove_page(spt, p);
 		}
 		addr += PGSIZE;
 		p = spt_find_page(spt, addr);
 	}
 }
+
+/* Do the msync */
+bool
+do_msync (void *addr, size_t length, int flags) {
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	size_t page_cnt = DIV_ROUND_UP(length, PGSIZE);
+
+	if ((flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) != 0
+			|| (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+		return false;
+	}
+	for (size_t i = 0; i < page_cnt; i++) {
+		if (spt_find_page(spt, addr + i * PGSIZE) == NULL) {
+			return false;
+		}
+	}
+
+	file_backed_sync(addr, length);
+	if (flags & MS_INVALIDATE) {
+		for (size_t i = 0; i < page_cnt; i++) {
+			struct page *page = spt_find_page(spt, addr + i * PGSIZE);
+			if (page_get_type(page) == VM_FILE) {
+				/* Leaves the page to be reread on its next fault. */
+				destroy(page);
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,288 @@
+/* ksm.c: Same-page merging for anonymous memory.
+ *
+ * ksmd, a low-priority kernel thread, walks frame_table a few pages at
+ * a time.  Each resident anonymous page is hashed; a page whose hash
+ * changed since the last visit is being written and is left alone.  A
+ * stable page is first looked up in the stable map, which holds the
+ * merged frames by content hash.  On a miss it is looked up in the
+ * unstable map, which holds the other stable pages seen in this pass
+ * and is emptied at the start of the next.  Two equal pages found there
+ * are copied into a new merged frame.
+ *
+ * A merged page keeps its anonymous page operations but has no frame of
+ * its own.  It is mapped read-only to the merged frame, and a write
+ * fault gives it a private copy again (see anon_swap_in()).  Merged
+ * frames are not in frame_table and are never evicted; each is freed
+ * with its last mapping. */
+
+#include "vm/ksm.h"
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "threads/interrupt.h"
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+
+/* ksmd sleeps this long between batches. */
+#define KSM_SLEEP_TICKS 10
+
+unsigned ksm_pages_to_scan;
+
+static struct hash stable_map;          /* Merged frames, by csum. */
+static struct lock ksm_lock;            /* Protects stable_map and refs. */
+
+/* The rest is protected by frame_table_lock. */
+static struct hash unstable_map;        /* Frames seen this pass, by csum. */
+static struct list_elem *cursor;        /* Next frame_table elem to scan. */
+
+/* Statistics. */
+static long long scan_cnt, merge_cnt;
+static size_t node_cnt, sharing_cnt;
+
+static void ksmd (void *aux UNUSED);
+static void ksm_scan_frame (struct frame *frame, struct list *freed);
+static bool ksm_merge (struct frame *frame, struct ksm_node *node,
+		struct list *freed);
+static struct ksm_node *ksm_new_node (struct frame *frame);
+static uint64_t node_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool node_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED);
+static uint64_t frame_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool frame_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED);
+static void frame_unlist (struct hash_elem *e, void *aux UNUSED);
+
+/* Sets up the maps and starts ksmd if it is enabled. */
+void
+ksm_init (void) {
+	hash_init (&stable_map, node_hash, node_less, NULL);
+	hash_init (&unstable_map, frame_hash, frame_less, NULL);
+	lock_init (&ksm_lock);
+	cursor = list_end (&frame_table);
+	if (ksm_pages_to_scan > 0)
+		thread_create ("ksmd", PRI_MIN, ksmd, NULL);
+}
+
+/* Maps PAGE, an anonymous page of the current process without a frame,
+ * read-only to NODE's frame.  Used by fork. */
+bool
+ksm_map (struct page *page, struct ksm_node *node) {
+	if (!pml4_set_page (thread_current ()->pml4, page->va, node->kva, false))
+		return false;
+	lock_acquire (&ksm_lock);
+	node->refs++;
+	sharing_cnt++;
+	lock_release (&ksm_lock);
+	page->ksm = node;
+	vm_account (thread_current (), VMC_SHARED, 1);
+	return true;
+}
+
+/* Drops one mapping of NODE, freeing it with the last. */
+void
+ksm_put (struct ksm_node *node) {
+	lock_acquire (&ksm_lock);
+	sharing_cnt--;
+	if (--node->refs > 0) {
+		lock_release (&ksm_lock);
+		return;
+	}
+	hash_delete (&stable_map, &node->elem);
+	node_cnt--;
+	lock_release (&ksm_lock);
+
+	palloc_free_page (node->kva);
+	free (node);
+}
+
+/* Called as FRAME leaves frame_table or is reused for another page.
+ * Caller holds frame_table_lock. */
+void
+ksm_forget (struct frame *frame) {
+	if (cursor == &frame->frame_elem)
+		cursor = list_next (cursor);
+	if (frame->ksm_unstable) {
+		hash_delete (&unstable_map, &frame->ksm_elem);
+		frame->ksm_unstable = false;
+	}
+	frame->ksm_csum = 0;
+}
+
+/* Prints merging statistics. */
+void
+ksm_print_stats (void) {
+	if (ksm_pages_to_scan == 0)
+		return;
+	printf ("KSM: %lld pages scanned, %lld merged, %zu frames shared "
+			"by %zu pages, %zu frames saved\n", scan_cnt, merge_cnt,
+			node_cnt, sharing_cnt, sharing_cnt - node_cnt);
+}
+
+/* The scanner thread. */
+static void
+ksmd (void *aux UNUSED) {
+	for (;;) {
+		struct list freed;
+
+		list_init (&freed);
+		timer_sleep (KSM_SLEEP_TICKS);
+		lock_acquire (&frame_table_lock);
+		for (unsigned i = 0; i < ksm_pages_to_scan && !list_empty (&frame_table);
+				i++) {
+			if (cursor == list_end (&frame_table)) {
+				/* A new pass forgets the last pass's candidates. */
+				hash_clear (&unstable_map, frame_unlist);
+				cursor = list_begin (&frame_table);
+			}
+			struct frame *frame = list_entry (cursor, struct frame, frame_elem);
+			cursor = list_next (cursor);
+			ksm_scan_frame (frame, &freed);
+		}
+		lock_release (&frame_table_lock);
+
+		while (!list_empty (&freed)) {
+			struct frame *frame = list_entry (list_pop_front (&freed),
+					struct frame, frame_elem);
+			palloc_free_page (frame->kva);
+			free (frame);
+		}
+	}
+}
+
+/* Tries to merge FRAME's page.  Merged frames are taken out of
+ * frame_table and added to FREED.  Caller holds frame_table_lock. */
+static void
+ksm_scan_frame (struct frame *frame, struct list *freed) {
+	struct page *page = frame->page;
+
+	if (page == NULL || VM_TYPE (page->operations->type) != VM_ANON
+			|| page->hugepage || page->lazy_free || frame->ksm_unstable
+			|| pml4_get_page (frame->thread->pml4, page->va) != frame->kva)
+		return;
+
+	scan_cnt++;
+	uint64_t csum = hash_bytes (frame->kva, PGSIZE);
+	if (csum != frame->ksm_csum) {
+		/* Changed since the last visit, or never seen. */
+		frame->ksm_csum = csum;
+		return;
+	}
+
+	lock_acquire (&ksm_lock);
+	struct ksm_node key;
+	key.csum = csum;
+	struct hash_elem *e = hash_find (&stable_map, &key.elem);
+	if (e != NULL) {
+		ksm_merge (frame, hash_entry (e, struct ksm_node, elem), freed);
+		lock_release (&ksm_lock);
+		return;
+	}
+
+	e = hash_insert (&unstable_map, &frame->ksm_elem);
+	if (e == NULL) {
+		frame->ksm_unstable = true;
+	} else {
+		struct frame *other = hash_entry (e, struct frame, ksm_elem);
+		struct ksm_node *node;
+		if (memcmp (frame->kva, other->kva, PGSIZE) == 0
+				&& (node = ksm_new_node (frame)) != NULL) {
+			hash_delete (&unstable_map, &other->ksm_elem);
+			other->ksm_unstable = false;
+			ksm_merge (frame, node, freed);
+			ksm_merge (other, node, freed);
+			if (node->refs == 0) {
+				hash_delete (&stable_map, &node->elem);
+				node_cnt--;
+				palloc_free_page (node->kva);
+				free (node);
+			}
+		}
+	}
+	lock_release (&ksm_lock);
+}
+
+/* Remaps FRAME's page read-only to NODE's frame if the two hold the
+ * same bytes, and moves FRAME from frame_table to FREED.  Returns true
+ * if merged.  Caller holds frame_table_lock and ksm_lock. */
+static bool
+ksm_merge (struct frame *frame, struct ksm_node *node, struct list *freed) {
+	struct page *page = frame->page;
+	struct thread *owner = frame->thread;
+	bool merged;
+
+	/* The owner cannot run, and so cannot write the page, between the
+	 * comparison and the remapping. */
+	enum intr_level old_level = intr_disable ();
+	merged = memcmp (frame->kva, node->kva, PGSIZE) == 0
+		&& pml4_set_page (owner->pml4, page->va, node->kva, false);
+	intr_set_level (old_level);
+	if (!merged)
+		return false;
+
+	page->frame = NULL;
+	page->ksm = node;
+	node->refs++;
+	sharing_cnt++;
+	merge_cnt++;
+	vm_frame_remove (frame);
+	list_push_back (freed, &frame->frame_elem);
+	vm_account (owner, VMC_ANON, -1);
+	vm_account (owner, VMC_SHARED, 1);
+	return true;
+}
+
+/* Returns a new merged frame holding a copy of FRAME, entered in the
+ * stable map with no mappings, or NULL if memory is short.  Caller
+ * holds ksm_lock. */
+static struct ksm_node *
+ksm_new_node (struct frame *frame) {
+	struct ksm_node *node = malloc (sizeof *node);
+	if (node == NULL)
+		return NULL;
+	node->kva = palloc_get_page (PAL_USER);
+	if (node->kva == NULL) {
+		free (node);
+		return NULL;
+	}
+	memcpy (node->kva, frame->kva, PGSIZE);
+	node->csum = frame->ksm_csum;
+	node->refs = 0;
+	hash_insert (&stable_map, &node->elem);
+	node_cnt++;
+	return node;
+}
+
+static uint64_t
+node_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_entry (e, struct ksm_node, elem)->csum;
+}
+
+static bool
+node_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct ksm_node, elem)->csum
+		< hash_entry (b, struct ksm_node, elem)->csum;
+}
+
+static uint64_t
+frame_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_entry (e, struct frame, ksm_elem)->ksm_csum;
+}
+
+static bool
+frame_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct frame, ksm_elem)->ksm_csum
+		< hash_entry (b, struct frame, ksm_elem)->ksm_csum;
+}
+
+static void
+frame_unlist (struct hash_elem *e, void *aux UNUSED) {
+	hash_entry (e, struct frame, ksm_elem)->ksm_unstable = false;
+}
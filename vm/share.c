@@ -0,0 +1,179 @@
+/* share.c: Frames shared by read-only file pages across processes.
+ *
+ * Read-only pages loaded from a file, such as program text, are kept in
+ * an index keyed by inode and page offset.  A process faulting on such a
+ * page maps the indexed frame instead of reading a private copy, so any
+ * number of processes running the same program hold one copy of its
+ * text.  Entries are reference counted and freed with their last
+ * mapping.  A write to the file drops the affected entries from the
+ * index; processes already mapping them keep the old contents, just as
+ * they would with private copies.
+ *
+ * A page is read in without share_lock held.  Its entry is indexed
+ * first, marked loading, and other processes faulting on the page wait
+ * for the read to finish. */
+
+#include "vm/share.h"
+#include <stdio.h>
+#include <string.h>
+#include "filesys/file.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+static struct hash share_map;           /* Indexed entries. */
+static struct lock share_lock;
+static struct condition share_loaded;   /* Signaled when a load ends. */
+
+/* Statistics. */
+static long long load_cnt, hit_cnt, invalidate_cnt;
+
+static uint64_t share_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool share_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED);
+static struct share_entry *share_find (struct inode *inode, off_t ofs);
+
+void
+share_init (void) {
+	hash_init (&share_map, share_hash, share_less, NULL);
+	lock_init (&share_lock);
+	cond_init (&share_loaded);
+}
+
+/* Returns a reference to the shared frame holding READ_BYTES bytes of
+ * FILE at OFS followed by zeros, reading it in if no process has it
+ * yet.  Returns NULL if the page cannot be shared, in which case the
+ * caller should load a private copy. */
+struct share_entry *
+share_get (struct file *file, off_t ofs, size_t read_bytes) {
+	struct inode *inode = file_get_inode (file);
+	struct share_entry *entry;
+
+	lock_acquire (&share_lock);
+	while ((entry = share_find (inode, ofs)) != NULL && entry->loading)
+		cond_wait (&share_loaded, &share_lock);
+	if (entry != NULL) {
+		if (entry->read_bytes != read_bytes)
+			entry = NULL;
+		else {
+			entry->refs++;
+			hit_cnt++;
+		}
+		lock_release (&share_lock);
+		return entry;
+	}
+
+	entry = malloc (sizeof *entry);
+	if (entry == NULL) {
+		lock_release (&share_lock);
+		return NULL;
+	}
+	entry->inode = inode;
+	entry->ofs = ofs;
+	entry->read_bytes = read_bytes;
+	entry->kva = NULL;
+	entry->refs = 1;
+	entry->indexed = true;
+	entry->loading = true;
+	hash_insert (&share_map, &entry->elem);
+	lock_release (&share_lock);
+
+	void *kva = palloc_get_page (PAL_USER);
+	bool loaded = kva != NULL
+		&& file_read_at (file, kva, read_bytes, ofs) == (off_t) read_bytes;
+	if (loaded)
+		memset (kva + read_bytes, 0, PGSIZE - read_bytes);
+
+	lock_acquire (&share_lock);
+	entry->loading = false;
+	cond_broadcast (&share_loaded, &share_lock);
+	if (!loaded) {
+		if (entry->indexed)
+			hash_delete (&share_map, &entry->elem);
+		lock_release (&share_lock);
+		if (kva != NULL)
+			palloc_free_page (kva);
+		free (entry);
+		return NULL;
+	}
+	entry->kva = kva;
+	load_cnt++;
+	lock_release (&share_lock);
+	return entry;
+}
+
+/* Drops a reference to ENTRY, freeing the frame with the last one. */
+void
+share_put (struct share_entry *entry) {
+	lock_acquire (&share_lock);
+	ASSERT (entry->refs > 0);
+	if (--entry->refs > 0) {
+		lock_release (&share_lock);
+		return;
+	}
+	if (entry->indexed)
+		hash_delete (&share_map, &entry->elem);
+	lock_release (&share_lock);
+
+	palloc_free_page (entry->kva);
+	free (entry);
+}
+
+/* Called after SIZE bytes of INODE at OFS were written: stops sharing
+ * the pages that overlap them. */
+void
+share_invalidate (struct inode *inode, off_t ofs, off_t size) {
+	if (size <= 0)
+		return;
+
+	lock_acquire (&share_lock);
+	if (!hash_empty (&share_map)) {
+		off_t end = ofs + size;
+		for (ofs &= ~(off_t) PGMASK; ofs < end; ofs += PGSIZE) {
+			struct share_entry *entry = share_find (inode, ofs);
+			if (entry != NULL) {
+				hash_delete (&share_map, &entry->elem);
+				entry->indexed = false;
+				invalidate_cnt++;
+			}
+		}
+	}
+	lock_release (&share_lock);
+}
+
+/* Prints shared frame statistics. */
+void
+share_print_stats (void) {
+	printf ("Shared frames: %lld loaded, %lld mappings reused, "
+			"%lld invalidated\n", load_cnt, hit_cnt, invalidate_cnt);
+}
+
+static uint64_t
+share_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct share_entry *entry = hash_entry (e, struct share_entry, elem);
+	return hash_bytes (&entry->inode, sizeof entry->inode) ^ entry->ofs;
+}
+
+static bool
+share_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct share_entry *a = hash_entry (a_, struct share_entry, elem);
+	const struct share_entry *b = hash_entry (b_, struct share_entry, elem);
+	if (a->inode != b->inode)
+		return a->inode < b->inode;
+	return a->ofs < b->ofs;
+}
+
+/* Returns the indexed entry for OFS in INODE, or NULL.  Caller holds
+ * share_lock. */
+static struct share_entry *
+share_find (struct inode *inode, off_t ofs) {
+	struct share_entry key;
+	struct hash_elem *e;
+
+	key.inode = inode;
+	key.ofs = ofs;
+	e = hash_find (&share_map, &key.elem);
+	return e != NULL ? hash_entry (e, struct share_entry, elem) : NULL;
+}
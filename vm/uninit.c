@@ -10,6 +10,8 @@
 
 #include "vm/vm.h"
 #include "vm/uninit.h"
+#include "vm/share.h"
+#include "threads/mmu.h"
 
 static bool uninit_initialize (struct page *page, void *kva);
 static void uninit_destroy (struct page *page);
@@ -65,4 +67,17 @@ uninit_destroy (struct page *page) {
 	struct uninit_page *uninit UNUSED = &page->uninit;
 	/* TODO: Fill this function.
 	 * TODO: If you don't have anything to do, just return. */
+	/* Unmap the shared zero frame so pml4_destroy() won't free it. */
+	if (page->zero_mapped) {
+		pml4_clear_page(thread_current()->pml4, page->va);
+		page->zero_mapped = false;
+	}
+	/* Likewise for a shared file frame, which is freed with its last
+	 * mapping. */
+	if (page->shared != NULL) {
+		pml4_clear_page(thread_current()->pml4, page->va);
+		share_put(page->shared);
+		page->shared = NULL;
+		vm_account(thread_current(), VMC_SHARED, -1);
+	}
 }
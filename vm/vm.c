@@ -3,9 +3,16 @@
 #include "threads/malloc.h"
 #include "vm/vm.h"
 #include "vm/inspect.h"
+#include "vm/zswap.h"
+#include "vm/share.h"
+#include "vm/evict.h"
+#include "vm/ksm.h"
 #include "threads/vaddr.h"
 #include "threads/mmu.h"
+#include "devices/timer.h"
+#include "userprog/syscall.h"
 #include "include/lib/string.h"
+#include <stdio.h>
 
 /* for spt*/
 unsigned page_hash (const struct hash_elem *p_, void *aux UNUSED);
@@ -14,8 +21,50 @@ void page_kill (struct hash_elem *e, void *aux);
 /* -------*/
 
 struct list frame_table;
-struct list_elem *clock_ref;
 struct lock frame_table_lock;
+static struct condition frame_unpinned;  /* A pinned frame was released. */
+static size_t frame_cnt;           /* Number of frames in frame_table. */
+
+/* Page-out daemon.  Woken when free user frames drop below
+ * free_low, it reclaims frames in batches of KSWAPD_BATCH until
+ * free_high frames are free again. */
+#define KSWAPD_BATCH 16
+static size_t free_low, free_high;
+static bool kswapd_running;
+static struct lock kswapd_lock;
+static struct condition kswapd_cond;
+
+static void kswapd (void *aux UNUSED);
+static void kswapd_wakeup (void);
+
+/* Shared read-only frame of zeros, mapped on read faults of pages
+ * that have never been written. */
+static void *zero_kva;
+static long long zero_map_cnt, zero_break_cnt;
+
+/* Readahead.  Faults on file-backed and swapped-out pages also load
+ * the pages that follow.  The window starts at RA_INIT_WINDOW pages,
+ * doubles each time a fault lands just past the previous window, and
+ * halves on any other fault, so streams grow toward the maximum and
+ * random access falls back to one page per fault.  The maximum is
+ * set with "-fa=N"; 1 disables readahead. */
+#define RA_INIT_WINDOW 4
+unsigned fault_around_pages = 16;
+static long long ra_file_cnt, ra_swap_cnt, ra_hit_cnt, ra_miss_cnt;
+
+/* Out-of-memory handling.  Every process with an address space is on
+ * mm_list.  When no frame can be evicted, vm_oom_kill() picks the
+ * process with the highest badness, which exits with status -1 the
+ * next time it enters or leaves the kernel, and waits up to
+ * OOM_WAIT_TICKS for it to release its memory.  A caller holding a
+ * lock does not wait, since the victim may be blocked on that lock
+ * and never get to exit; its allocation fails instead. */
+#define OOM_WAIT_TICKS 100
+static struct list mm_list;
+static struct lock mm_list_lock;
+
+static bool vm_oom_kill (void);
+static bool mm_listed (tid_t tid);
 
 /* Initializes the virtual memory subsystem by invoking each subsystem's
  * intialize codes. */
@@ -30,8 +79,36 @@ vm_init (void) {
 	/* DO NOT MODIFY UPPER LINES. */
 	/* TODO: Your code goes here. */
 	list_init(&frame_table);
-	clock_ref = list_begin(&frame_table);
 	lock_init(&frame_table_lock);
+	cond_init(&frame_unpinned);
+	evict_init();
+	list_init(&mm_list);
+	lock_init(&mm_list_lock);
+
+	zero_kva = palloc_get_page(PAL_ASSERT | PAL_ZERO);
+	share_init();
+	ksm_init();
+
+	free_low = palloc_pool_size(PAL_USER) / 64 + 4;
+	free_high = free_low * 2;
+	lock_init(&kswapd_lock);
+	cond_init(&kswapd_cond);
+	thread_create("kswapd", PRI_DEFAULT, kswapd, NULL);
+}
+
+/* Prints virtual memory statistics. */
+void
+vm_print_stats (void) {
+	printf ("Zero page: %lld mappings, %lld broken by writes\n",
+			zero_map_cnt, zero_break_cnt);
+	printf ("Readahead: %lld file pages, %lld swap pages, "
+			"%lld sequential faults, %lld random faults\n",
+			ra_file_cnt, ra_swap_cnt, ra_hit_cnt, ra_miss_cnt);
+	share_print_stats ();
+	file_backed_print_stats ();
+	zswap_print_stats ();
+	evict_print_stats ();
+	ksm_print_stats ();
 }
 
 /* Get the type of the page. This function is useful if you want to know the
@@ -52,6 +129,18 @@ page_get_type (struct page *page) {
 static struct frame *vm_get_victim (void);
 static bool vm_do_claim_page (struct page *page);
 static struct frame *vm_evict_frame (void);
+static bool page_is_zero_fill (struct page *page);
+static bool vm_map_zero_page (struct page *page);
+static bool vm_map_shared_page (struct page *page);
+static bool vm_claim_huge (struct page *page);
+static void vm_frame_insert (struct frame *frame);
+static bool page_file_segment (struct page *page, struct segment *seg);
+static struct readahead *ra_get (void *key);
+static unsigned ra_window (struct readahead *ra, void *va, int advice);
+static void vm_readahead_file (void *va, const struct segment *seg, int advice);
+static void vm_readahead_swap (void *va, long slot_no, int advice);
+static bool vm_page_out (struct frame *victim);
+static enum vm_counter resident_counter (struct page *page);
 
 /* Create the pending page object with initializer. If you want to create a
  * page, do not create it directly and make it through this function or
@@ -133,82 +222,319 @@ spt_remove_page (struct supplemental_page_table *spt, struct page *page) {
 	return true;
 }
 
-/* Get the struct frame, that will be evicted. */
+/* Get the struct frame, that will be evicted.
+ * The choice is made by the policy selected with "-evict=" (see
+ * evict.c).  Returns NULL if no frame can be evicted.  Caller must
+ * hold frame_table_lock. */
 static struct frame *
 vm_get_victim (void) {
-	struct frame *victim = NULL;
-	 /* TODO: The policy for eviction is up to you. */
-	struct thread *curr = thread_current();
-
-	lock_acquire(&frame_table_lock);
-	for (clock_ref; clock_ref != list_end(&frame_table); clock_ref = list_next(clock_ref)) {
-		victim = list_entry(clock_ref, struct frame, frame_elem);
-		if (pml4_is_accessed(curr->pml4, victim->page->va)) {
-			pml4_set_accessed(curr->pml4, victim->page->va, false);
-		}
-		else {
-			lock_release(&frame_table_lock);
-			return victim;
-		}
-	}
-
-	struct list_elem *start = list_begin(&frame_table);
-
-	for (start; start != list_end(&frame_table); start = list_next(start)) {
-		victim = list_entry(start, struct frame, frame_elem);
-		if (pml4_is_accessed(curr->pml4, victim->page->va)) {
-			pml4_set_accessed(curr->pml4, victim->page->va, false);
-		}
-		else {
-			clock_ref = start;
-			lock_release(&frame_table_lock);
-			return victim;
-		}
-	}
-	lock_release(&frame_table_lock);
-	ASSERT(clock_ref != NULL);
-	return victim;
+	ASSERT (lock_held_by_current_thread(&frame_table_lock));
+	return evict_victim();
 }
 
 /* Evict one page and return the corresponding frame.
+ * The frame stays in frame_table with no page attached.
  * Return NULL on error.*/
 static struct frame *
 vm_evict_frame (void) {
+	lock_acquire(&frame_table_lock);
 	struct frame *victim = vm_get_victim ();
 	/* TODO: swap out the victim and return the evicted frame. */
-	if (victim->page) {
-		swap_out(victim->page);
+	if (victim != NULL && !vm_page_out(victim)) {
+		victim = NULL;
+	}
+	if (victim != NULL) {
+		/* The frame is reused: the policy sees it as new. */
+		evict_remove(victim);
+		evict_insert(victim);
+		ksm_forget(victim);
 	}
+	lock_release(&frame_table_lock);
 	return victim;
 }
 
+/* Swaps out the page in VICTIM and charges its owner.  Caller must
+ * hold frame_table_lock. */
+static bool
+vm_page_out (struct frame *victim) {
+	struct page *page = victim->page;
+	struct thread *owner = victim->thread;
+	bool clean = evict_frame_is_clean(victim);
+
+	if (!swap_out(page)) {
+		return false;
+	}
+	vm_account(owner, resident_counter(page), -1);
+	evict_record(clean);
+	page->evicted = true;
+	return true;
+}
+
 /* palloc() and get frame. If there is no available page, evict the page
- * and return it. This always return valid address. That is, if the user pool
- * memory is full, this function evicts the frame to get the available memory
- * space.*/
+ * and return it.  If nothing can be evicted either, the OOM killer ends
+ * a process and the allocation is retried.  Returns NULL if memory
+ * cannot be found that way. */
 static struct frame *
 vm_get_frame (void) {
 	
 	/* TODO: Fill this function. */
-	void *kva = palloc_get_page(PAL_USER);
+	for (;;) {
+		void *kva = palloc_get_page(PAL_USER);
+		kswapd_wakeup();
 
-	if (kva == NULL) {
-		struct frame *victim = vm_evict_frame();
-		victim->page = NULL;
-		return victim;
+		if (kva == NULL) {
+			struct frame *victim = vm_evict_frame();
+			if (victim != NULL) {
+				return victim;
+			}
+			if (!vm_oom_kill()) {
+				return NULL;
+			}
+			continue;
+		}
+		struct frame *frame = (struct frame *)malloc(sizeof(struct frame));
+		frame->kva = kva;
+		frame->page = NULL;
+		frame->thread = NULL;
+		vm_frame_insert(frame);
+
+		ASSERT (frame != NULL);
+		ASSERT (frame->page == NULL);
+
+		return frame;
+	}
+}
+
+/* Picks the process with the highest badness, its resident and
+ * swapped pages plus oom_score_adj thousandths of all user memory, and
+ * has it exit.  A process already picked is waited for again.  Returns
+ * true once the victim has released its memory, or false if the
+ * victim is the current process, or does not exit in time or before
+ * the current thread, which holds locks, would have to wait. */
+static bool
+vm_oom_kill (void) {
+	struct thread *cur = thread_current();
+	struct thread *victim = NULL;
+	long long worst = 0;
+	size_t swap_slots, swap_used;
+
+	anon_swap_usage(&swap_slots, &swap_used);
+	long long total = palloc_pool_size(PAL_USER) + swap_slots;
+
+	lock_acquire(&mm_list_lock);
+	for (struct list_elem *e = list_begin(&mm_list); e != list_end(&mm_list);
+			e = list_next(e)) {
+		struct thread *t = list_entry(e, struct thread, spt.mm_elem);
+		const size_t *c = t->vm_counters;
+		if (t->oom_score_adj == OOM_SCORE_ADJ_MIN) {
+			continue;
+		}
+		if (t->oom_killed) {
+			victim = t;
+			break;
+		}
+		long long badness = c[VMC_ANON] + c[VMC_FILE] + c[VMC_SWAP]
+			+ total * t->oom_score_adj / 1000;
+		if (victim == NULL || badness > worst) {
+			victim = t;
+			worst = badness;
+		}
+	}
+	if (victim == NULL) {
+		lock_release(&mm_list_lock);
+		return false;
+	}
+	if (!victim->oom_killed) {
+		victim->oom_killed = true;
+		printf("Out of memory: killed process %d (%s)\n", victim->tid, victim->name);
+	}
+	tid_t tid = victim->tid;
+	lock_release(&mm_list_lock);
+
+	if (victim == cur) {
+		return false;
 	}
-	struct frame *frame = (struct frame *)malloc(sizeof(struct frame));
-	frame->kva = kva;
-	frame->page = NULL;
+	for (int i = 0; i < OOM_WAIT_TICKS && cur->lock_cnt == 0
+			&& mm_listed(tid); i++) {
+		timer_sleep(1);
+	}
+	return !mm_listed(tid);
+}
+
+/* Returns true if the process TID still holds an address space. */
+static bool
+mm_listed (tid_t tid) {
+	bool found = false;
+
+	lock_acquire(&mm_list_lock);
+	for (struct list_elem *e = list_begin(&mm_list); e != list_end(&mm_list);
+			e = list_next(e)) {
+		if (list_entry(e, struct thread, spt.mm_elem)->tid == tid) {
+			found = true;
+			break;
+		}
+	}
+	lock_release(&mm_list_lock);
+	return found;
+}
 
+/* Exits the current process with status -1 if the OOM killer chose
+ * it. */
+void
+vm_oom_check (void) {
+	if (thread_current()->oom_killed) {
+		intr_enable();
+		exit(-1);
+	}
+}
+
+/* Adds FRAME to frame_table. */
+static void
+vm_frame_insert (struct frame *frame) {
 	lock_acquire(&frame_table_lock);
+	frame->ksm_csum = 0;
+	frame->ksm_unstable = false;
+	frame->pinned = false;
 	list_push_back(&frame_table, &frame->frame_elem);
+	frame_cnt++;
+	evict_insert(frame);
 	lock_release(&frame_table_lock);
-	
-	ASSERT (frame != NULL);
-	ASSERT (frame->page == NULL);
+}
+
+/* Removes FRAME from frame_table.  Caller must hold
+ * frame_table_lock. */
+void
+vm_frame_remove (struct frame *frame) {
+	evict_remove(frame);
+	ksm_forget(frame);
+	list_remove(&frame->frame_elem);
+	frame_cnt--;
+}
+
+/* Releases FRAME, pinned by writeback, and wakes anyone waiting to
+ * free it.  Caller must not hold frame_table_lock. */
+void
+vm_frame_unpin (struct frame *frame) {
+	lock_acquire(&frame_table_lock);
+	ASSERT (frame->pinned);
+	frame->pinned = false;
+	cond_broadcast(&frame_unpinned, &frame_table_lock);
+	lock_release(&frame_table_lock);
+}
+
+/* Waits until PAGE's frame, if it has one, is not pinned.  Caller must
+ * hold frame_table_lock. */
+void
+vm_frame_wait_unpinned (struct page *page) {
+	ASSERT (lock_held_by_current_thread(&frame_table_lock));
+	while (page->frame != NULL && page->frame->pinned) {
+		cond_wait(&frame_unpinned, &frame_table_lock);
+	}
+}
+
+/* Drops PAGE's frame, if it still has one: removes it from
+ * frame_table, unmaps it from the current thread and returns the
+ * memory to the user pool.  The check is made under
+ * frame_table_lock, so a concurrent eviction is never freed twice,
+ * and waits out a writeback that has the frame pinned. */
+void
+vm_free_frame (struct page *page) {
+	lock_acquire(&frame_table_lock);
+	vm_frame_wait_unpinned(page);
+	struct frame *frame = page->frame;
+	if (frame != NULL) {
+		vm_frame_remove(frame);
+		page->frame = NULL;
+		vm_account(frame->thread, resident_counter(page), -1);
+	}
+	lock_release(&frame_table_lock);
+
+	if (frame != NULL) {
+		pml4_clear_page(thread_current()->pml4, page->va);
+		palloc_free_page(frame->kva);
+		free(frame);
+	}
+}
+
+/* Wakes kswapd if free user frames have dropped below free_low. */
+static void
+kswapd_wakeup (void) {
+	if (palloc_free_cnt(PAL_USER) >= free_low) {
+		return;
+	}
+	lock_acquire(&kswapd_lock);
+	if (!kswapd_running) {
+		kswapd_running = true;
+		cond_signal(&kswapd_cond, &kswapd_lock);
+	}
+	lock_release(&kswapd_lock);
+}
+
+/* Writes back up to KSWAPD_BATCH dirty file-backed frames, in file
+ * order, so that evicting them later needs no disk write.  The frames
+ * are pinned under frame_table_lock and written after it is dropped. */
+static void
+kswapd_clean (void) {
+	struct page *dirty[KSWAPD_BATCH];
+	size_t cnt = 0;
+
+	lock_acquire(&frame_table_lock);
+	for (struct list_elem *e = list_begin(&frame_table);
+			e != list_end(&frame_table) && cnt < KSWAPD_BATCH; e = list_next(e)) {
+		struct frame *frame = list_entry(e, struct frame, frame_elem);
+		if (frame->page != NULL && page_get_type(frame->page) == VM_FILE
+				&& file_backed_writeback_pin(frame->page)) {
+			dirty[cnt++] = frame->page;
+		}
+	}
+	lock_release(&frame_table_lock);
+	file_backed_writeback_batch(dirty, cnt);
+}
+
+/* Evicts up to KSWAPD_BATCH frames and returns them to the user pool.
+ * Returns false if nothing could be evicted. */
+static bool
+kswapd_reclaim (void) {
+	struct frame *reclaimed[KSWAPD_BATCH];
+	int cnt = 0;
+
+	lock_acquire(&frame_table_lock);
+	while (cnt < KSWAPD_BATCH) {
+		struct frame *victim = vm_get_victim();
+		if (victim == NULL || !vm_page_out(victim)) {
+			break;
+		}
+		vm_frame_remove(victim);
+		reclaimed[cnt++] = victim;
+	}
+	lock_release(&frame_table_lock);
+
+	for (int i = 0; i < cnt; i++) {
+		palloc_free_page(reclaimed[i]->kva);
+		free(reclaimed[i]);
+	}
+	return cnt > 0;
+}
+
+/* Page-out daemon thread. */
+static void
+kswapd (void *aux UNUSED) {
+	for (;;) {
+		lock_acquire(&kswapd_lock);
+		while (!kswapd_running) {
+			cond_wait(&kswapd_cond, &kswapd_lock);
+		}
+		lock_release(&kswapd_lock);
 
-	return frame;
+		kswapd_clean();
+		while (palloc_free_cnt(PAL_USER) < free_high && kswapd_reclaim()) {
+			continue;
+		}
+
+		lock_acquire(&kswapd_lock);
+		kswapd_running = false;
+		lock_release(&kswapd_lock);
+	}
 }
 
 /* Growing the stack. */
@@ -232,10 +558,27 @@ vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
 	struct page *page = NULL;
 	/* TODO: Validate the fault */
 	/* TODO: Your code goes here */
-	if (is_kernel_vaddr(addr) || addr == NULL || !not_present) {
+	if (is_kernel_vaddr(addr) || addr == NULL || thread_current()->oom_killed) {
 		return false;
 	}
 
+	if (!not_present) {
+		/* First write to a page backed by the shared zero frame, or
+		 * to a page merged by ksmd. */
+		page = spt_find_page(spt, addr);
+		if (page == NULL || !write || !page->writable
+				|| (!page->zero_mapped && page->ksm == NULL)) {
+			return false;
+		}
+		pml4_clear_page(thread_current()->pml4, page->va);
+		if (page->zero_mapped) {
+			page->zero_mapped = false;
+			zero_break_cnt++;
+		}
+		vm_account(thread_current(), VMC_MINFLT, 1);
+		return vm_do_claim_page(page);
+	}
+
 	if (not_present) {
 		struct thread *cur = thread_current();
 		void *rsp = f->rsp; // user access인 경우 rsp는 유저 stack을 가리킨다.
@@ -257,11 +600,298 @@ vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
 		if (write && !page->writable) {
 			return false;
 		}
-		return vm_do_claim_page(page);
+		if (page->hugepage && vm_claim_huge(page)) {
+			vm_account(cur, VMC_MINFLT, 1);
+			return true;
+		}
+		if (!write && page_is_zero_fill(page)) {
+			vm_account(cur, VMC_MINFLT, 1);
+			return vm_map_zero_page(page);
+		}
+
+		/* The page's uninit data and swap slot are gone once it is
+		 * claimed. */
+		struct segment seg;
+		bool from_file = page_file_segment(page, &seg);
+		long slot_no = VM_TYPE(page->operations->type) == VM_ANON
+			? page->anon.slot_no : -1;
+		bool major = from_file || slot_no != -1
+			|| VM_TYPE(page->operations->type) == VM_FILE;
+		vm_account(cur, major ? VMC_MAJFLT : VMC_MINFLT, 1);
+		if (!vm_do_claim_page(page)) {
+			return false;
+		}
+		if (from_file) {
+			vm_readahead_file(page->va, &seg, page->advice);
+		} else if (slot_no != -1) {
+			vm_readahead_swap(page->va, slot_no, page->advice);
+		}
+		return true;
 	}
 	return true;
 }
 
+/* If PAGE has not been loaded yet and will be read from a file,
+ * copies its segment into *SEG and returns true. */
+static bool
+page_file_segment (struct page *page, struct segment *seg) {
+	if (VM_TYPE(page->operations->type) != VM_UNINIT
+			|| page->uninit.init != lazy_load_segment
+			|| page->shared != NULL) {
+		return false;
+	}
+	*seg = *(struct segment *)page->uninit.aux;
+	return seg->page_read_bytes > 0;
+}
+
+/* Returns the current thread's readahead state for KEY, moved to
+ * the front.  A new stream replaces the least recently used one. */
+static struct readahead *
+ra_get (void *key) {
+	struct readahead *ra = thread_current()->ra;
+	struct readahead found;
+	int i;
+
+	for (i = 0; i < RA_STREAMS - 1; i++) {
+		if (ra[i].window != 0 && ra[i].key == key) {
+			break;
+		}
+	}
+	found = ra[i];
+	if (found.window == 0 || found.key != key) {
+		found.key = key;
+		found.next_va = NULL;
+		found.window = RA_INIT_WINDOW;
+	}
+	memmove(&ra[1], &ra[0], i * sizeof *ra);
+	ra[0] = found;
+	return &ra[0];
+}
+
+/* Adjusts RA's window for a fault on VA, in a page with madvise()
+ * ADVICE, and returns it. */
+static unsigned
+ra_window (struct readahead *ra, void *va, int advice) {
+	if (advice == MADV_RANDOM) {
+		return 1;
+	}
+	if (advice == MADV_SEQUENTIAL) {
+		ra->window = fault_around_pages;
+	} else if (ra->next_va == NULL) {
+		/* First fault of the stream. */
+	} else if (va == ra->next_va) {
+		ra->window *= 2;
+		ra_hit_cnt++;
+	} else {
+		ra->window /= 2;
+		ra_miss_cnt++;
+	}
+	if (ra->window > fault_around_pages) {
+		ra->window = fault_around_pages;
+	}
+	if (ra->window < 1) {
+		ra->window = 1;
+	}
+	return ra->window;
+}
+
+/* File readahead.  After a fault on VA, which was loaded from SEG,
+ * also loads and maps the following pages of the same file region, up
+ * to the stream's window in total.  The pages are read in file order
+ * and mapped with the accessed bit clear, so the clock reclaims them
+ * first if they go unused.  Stops early rather than evict. */
+static void
+vm_readahead_file (void *va, const struct segment *seg, int advice) {
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	struct readahead *ra = ra_get(seg->file);
+	unsigned window = ra_window(ra, va, advice);
+	unsigned i = 1;
+
+	if (seg->page_read_bytes == PGSIZE) {
+		for (; i < window; i++) {
+			if (palloc_free_cnt(PAL_USER) <= free_high) {
+				break;
+			}
+
+			struct page *page = spt_find_page(spt, va + i * PGSIZE);
+			struct segment next;
+			if (page == NULL || !page_file_segment(page, &next)
+					|| next.file != seg->file
+					|| next.ofs != seg->ofs + (off_t) (i * PGSIZE)) {
+				break;
+			}
+			if (!vm_do_claim_page(page)) {
+				break;
+			}
+			ra_file_cnt++;
+			if (next.page_read_bytes < PGSIZE) {
+				i++;
+				break;
+			}
+		}
+	}
+	ra->next_va = va + i * PGSIZE;
+}
+
+/* Swap readahead.  Pages evicted together are given consecutive
+ * slots by the next-fit slot allocator, so after swapping in VA from
+ * SLOT_NO, the following pages whose slots continue the run are
+ * brought in too, up to the window. */
+static void
+vm_readahead_swap (void *va, long slot_no, int advice) {
+	struct supplemental_page_table *spt = &thread_current()->spt;
+	struct readahead *ra = ra_get(NULL);
+	unsigned window = ra_window(ra, va, advice);
+	unsigned i;
+
+	for (i = 1; i < window; i++) {
+		if (palloc_free_cnt(PAL_USER) <= free_high) {
+			break;
+		}
+
+		struct page *page = spt_find_page(spt, va + i * PGSIZE);
+		if (page == NULL || VM_TYPE(page->operations->type) != VM_ANON
+				|| page->frame != NULL
+				|| page->anon.slot_no != slot_no + (long) i) {
+			break;
+		}
+		if (!vm_do_claim_page(page)) {
+			break;
+		}
+		ra_swap_cnt++;
+	}
+	ra->next_va = va + i * PGSIZE;
+}
+
+/* Returns true if PAGE has never been touched and would be filled
+ * with zeros on its first fault: anonymous stack pages and the
+ * zero-only pages of a segment's BSS. */
+static bool
+page_is_zero_fill (struct page *page) {
+	if (VM_TYPE(page->operations->type) != VM_UNINIT
+			|| VM_TYPE(page->uninit.type) != VM_ANON) {
+		return false;
+	}
+	if (page->uninit.init == NULL) {
+		return true;
+	}
+	return page->uninit.init == lazy_load_segment
+		&& ((struct segment *)page->uninit.aux)->page_read_bytes == 0;
+}
+
+/* Maps PAGE read-only to the shared zero frame.  The page stays
+ * uninit; a later write fault gives it a frame of its own. */
+static bool
+vm_map_zero_page (struct page *page) {
+	if (!install_page(page->va, zero_kva, false)) {
+		return false;
+	}
+	page->zero_mapped = true;
+	zero_map_cnt++;
+	return true;
+}
+
+/* Maps PAGE read-only to the frame shared by every process mapping
+ * the same page of the same file, reading it in if needed.  Only
+ * read-only pages that would be loaded from a file are shared, and
+ * PAGE stays uninit.  Returns false if PAGE needs a frame of its own. */
+static bool
+vm_map_shared_page (struct page *page) {
+	struct segment seg;
+	if (page->writable || !page_file_segment(page, &seg)) {
+		return false;
+	}
+
+	kswapd_wakeup();
+	struct share_entry *entry = share_get(seg.file, seg.ofs, seg.page_read_bytes);
+	if (entry == NULL) {
+		return false;
+	}
+	if (!install_page(page->va, entry->kva, false)) {
+		share_put(entry);
+		return false;
+	}
+	page->shared = entry;
+	vm_account(thread_current(), VMC_SHARED, 1);
+	return true;
+}
+
+/* Returns true if P is an untouched anonymous page advised
+ * MADV_HUGEPAGE with the given WRITABLE permission. */
+static bool
+page_is_huge_candidate (struct page *p, bool writable) {
+	return p != NULL && p->hugepage && p->writable == writable
+		&& VM_TYPE(p->operations->type) == VM_UNINIT
+		&& VM_TYPE(p->uninit.type) == VM_ANON
+		&& !p->zero_mapped && p->shared == NULL;
+}
+
+/* Tries to load the whole 2 MB-aligned region around PAGE into an
+ * aligned run of frames and map it with one 2 MB page.  Every page in
+ * the region must be an untouched MADV_HUGEPAGE anonymous page.  Each
+ * 4 kB page still has its own frame in frame_table, so eviction and
+ * teardown work page by page; the first of them splits the mapping.
+ * Returns true if PAGE was mapped. */
+static bool
+vm_claim_huge (struct page *page) {
+	struct thread *t = thread_current();
+	void *base = huge_round_down(page->va);
+	size_t loaded = 0;
+
+	if (!is_user_vaddr(base + HUGE_PGSIZE - PGSIZE)
+			|| palloc_free_cnt(PAL_USER) < HUGE_PGCNT + free_high) {
+		return false;
+	}
+	for (size_t i = 0; i < HUGE_PGCNT; i++) {
+		void *va = base + i * PGSIZE;
+		if (!page_is_huge_candidate(spt_find_page(&t->spt, va), page->writable)
+				|| pml4_get_page(t->pml4, va) != NULL) {
+			return false;
+		}
+	}
+
+	void *kva = palloc_get_aligned(PAL_USER, HUGE_PGCNT, HUGE_PGCNT);
+	if (kva == NULL) {
+		return false;
+	}
+	kswapd_wakeup();
+
+	/* Load every page before anything is mapped or visible to the
+	 * clock, so no frame can be evicted from under the 2 MB page. */
+	for (; loaded < HUGE_PGCNT; loaded++) {
+		struct page *p = spt_find_page(&t->spt, base + loaded * PGSIZE);
+		struct frame *frame = malloc(sizeof *frame);
+		if (frame == NULL) {
+			break;
+		}
+		frame->kva = kva + loaded * PGSIZE;
+		frame->page = p;
+		frame->thread = t;
+		p->frame = frame;
+		if (!swap_in(p, frame->kva)) {
+			p->frame = NULL;
+			free(frame);
+			break;
+		}
+	}
+
+	bool huge = loaded == HUGE_PGCNT
+		&& pml4_set_huge_page(t->pml4, base, kva, page->writable);
+	for (size_t i = 0; i < HUGE_PGCNT; i++) {
+		if (i >= loaded) {
+			palloc_free_page(kva + i * PGSIZE);
+			continue;
+		}
+		struct page *p = spt_find_page(&t->spt, base + i * PGSIZE);
+		if (!huge && !install_page(p->va, p->frame->kva, p->writable)) {
+			PANIC("cannot map a loaded page");
+		}
+		vm_frame_insert(p->frame);
+		vm_account(t, VMC_ANON, 1);
+	}
+	return page->frame != NULL;
+}
+
 /* Free the page.
  * DO NOT MODIFY THIS FUNCTION. */
 void
@@ -282,23 +912,168 @@ vm_claim_page (void *va UNUSED) {
 	return vm_do_claim_page (page);
 }
 
+/* Applies madvise() ADVICE to PAGE, of the current thread T. */
+static void
+madvise_page (struct thread *t, struct page *page, int advice) {
+	switch (advice) {
+		case MADV_NORMAL:
+		case MADV_SEQUENTIAL:
+		case MADV_RANDOM:
+			page->advice = advice;
+			break;
+		case MADV_WILLNEED:
+			/* Like readahead, stop rather than evict. */
+			if (pml4_get_page(t->pml4, page->va) == NULL && !page_is_zero_fill(page)
+					&& palloc_free_cnt(PAL_USER) > free_high) {
+				vm_do_claim_page(page);
+			}
+			break;
+		case MADV_DONTNEED:
+			/* Every destroy operation releases the page's memory
+			 * but leaves it able to fault back in: file pages are
+			 * written back and reread, uninit pages are loaded
+			 * again, and anonymous pages come back as zeros. */
+			destroy(page);
+			break;
+		case MADV_FREE:
+			/* Only anonymous contents can be thrown away; clear
+			 * the dirty bit so a later write can be noticed. */
+			if (VM_TYPE(page->operations->type) == VM_ANON
+					&& page->frame != NULL) {
+				pml4_set_dirty(t->pml4, page->va, false);
+				page->lazy_free = true;
+			}
+			break;
+		case MADV_HUGEPAGE:
+			/* Takes effect when the 2 MB region is first touched. */
+			page->hugepage = true;
+			break;
+	}
+}
+
+/* madvise(): applies ADVICE to the current process's pages in
+ * [ADDR, ADDR + LENGTH).  Pages that do not exist are skipped, and a
+ * range with more pages than the process has is not walked page by
+ * page: the pages in it are picked out of the SPT instead.  Returns
+ * false if ADVICE is unknown, the range wraps around, or memory runs
+ * out. */
+bool
+vm_madvise (void *addr, size_t length, int advice) {
+	struct thread *t = thread_current();
+	struct hash *spt_hash = &t->spt.spt_hash;
+	void *start = pg_round_down(addr);
+	void *end;
+
+	if (advice < MADV_NORMAL || advice > MADV_HUGEPAGE) {
+		return false;
+	}
+	if (length > UINTPTR_MAX - PGSIZE - (uintptr_t) addr) {
+		return false;
+	}
+	end = pg_round_up(addr + length);
+
+	if ((size_t) (end - start) / PGSIZE <= hash_size(spt_hash)) {
+		for (void *va = start; va < end; va += PGSIZE) {
+			struct page *page = spt_find_page(&t->spt, va);
+			if (page != NULL) {
+				madvise_page(t, page, advice);
+			}
+		}
+		return true;
+	}
+
+	/* Advice may fault pages in, so pick the pages first. */
+	struct page **pages = malloc(hash_size(spt_hash) * sizeof *pages);
+	struct hash_iterator i;
+	size_t cnt = 0;
+
+	if (pages == NULL) {
+		return false;
+	}
+	hash_first(&i, spt_hash);
+	while (hash_next(&i)) {
+		struct page *page = hash_entry(hash_cur(&i), struct page, hash_elem);
+		if (page->va >= start && page->va < end) {
+			pages[cnt++] = page;
+		}
+	}
+	for (size_t j = 0; j < cnt; j++) {
+		madvise_page(t, pages[j], advice);
+	}
+	free(pages);
+	return true;
+}
+
 /* Claim the PAGE and set up the mmu. */
 static bool
 vm_do_claim_page (struct page *page) {
+	if (vm_map_shared_page(page)) {
+		return true;
+	}
+
 	struct frame *frame = vm_get_frame ();
+	if (frame == NULL) {
+		return false;
+	}
 
-	/* Set links */
-	frame->page = page;
+	/* Set links.  frame->page is only set once the contents are in, so
+	 * the clock never picks a frame that is still being filled. */
 	page->frame = frame;
+	frame->thread = thread_current();
 
 	/* TODO: Insert page table entry to map page's VA to frame's PA. */
-	struct thread *cur = thread_current();
-	if (install_page(page->va, frame->kva, page->writable)) {
-		return swap_in (page, frame->kva);
-	}
-	else {
+	if (!install_page(page->va, frame->kva, page->writable)
+			|| !swap_in (page, frame->kva)) {
 		return false;
 	}
+	frame->page = page;
+	vm_account(frame->thread, resident_counter(page), 1);
+	if (page->evicted) {
+		evict_refault();
+		page->evicted = false;
+	}
+	return true;
+}
+
+/* Returns the counter that PAGE's frame is charged to. */
+static enum vm_counter
+resident_counter (struct page *page) {
+	return page_get_type(page) == VM_FILE ? VMC_FILE : VMC_ANON;
+}
+
+/* Adds DELTA to T's COUNTER, and raises T's peak RSS to match.  kswapd
+ * charges evictions to other processes, so the update is made with
+ * interrupts off. */
+void
+vm_account (struct thread *t, enum vm_counter counter, int delta) {
+	size_t *c = t->vm_counters;
+	enum intr_level old_level = intr_disable();
+
+	c[counter] += delta;
+	size_t rss = c[VMC_ANON] + c[VMC_FILE] + c[VMC_SHARED];
+	if (rss > c[VMC_PEAK_RSS]) {
+		c[VMC_PEAK_RSS] = rss;
+	}
+	intr_set_level(old_level);
+}
+
+/* Fills *MS with T's memory counters and the state of the user pool,
+ * frame table and swap disk. */
+void
+vm_memstat (struct thread *t, struct memstat *ms) {
+	const size_t *c = t->vm_counters;
+
+	ms->rss_anon = c[VMC_ANON];
+	ms->rss_file = c[VMC_FILE];
+	ms->rss_shared = c[VMC_SHARED];
+	ms->swapped = c[VMC_SWAP];
+	ms->peak_rss = c[VMC_PEAK_RSS];
+	ms->minor_faults = c[VMC_MINFLT];
+	ms->major_faults = c[VMC_MAJFLT];
+	ms->user_pages = palloc_pool_size(PAL_USER);
+	ms->user_free = palloc_free_cnt(PAL_USER);
+	ms->frames = frame_cnt;
+	anon_swap_usage(&ms->swap_slots, &ms->swap_used);
 }
 
 
@@ -329,6 +1104,10 @@ page_kill (struct hash_elem *e, void *aux) {
 void
 supplemental_page_table_init (struct supplemental_page_table *spt UNUSED) {
 	hash_init(&spt->spt_hash, page_hash, page_less, NULL);
+
+	lock_acquire(&mm_list_lock);
+	list_push_back(&mm_list, &spt->mm_elem);
+	lock_release(&mm_list_lock);
 }
 
 /* Copy supplemental page table from src to dst */
@@ -402,37 +1181,70 @@ supplemental_page_table_copy (struct supplemental_page_table *dst UNUSED,
 		if (now_type == VM_UNINIT) {
 			vm_initializer *init = parent_page->uninit.init;
 			void *aux = parent_page->uninit.aux;
-			struct segment *file_loader = (struct segment *)aux;
-            struct segment *new_file_loader = malloc(sizeof(struct segment));
-            memcpy(new_file_loader, aux, sizeof(struct segment));
-            new_file_loader->file = file_duplicate(file_loader->file);
-			
-			if (!vm_alloc_page_with_initializer(type, upage, writable, init, new_file_loader)) {
-				free(new_file_loader);
-				return false;
+			struct segment *new_file_loader = NULL;
+
+			/* Stack pages have no segment to load from. */
+			if (aux != NULL) {
+				new_file_loader = malloc(sizeof(struct segment));
+				if (new_file_loader == NULL) {
+					return false;
+				}
+				memcpy(new_file_loader, aux, sizeof(struct segment));
+				new_file_loader->file = file_duplicate(((struct segment *)aux)->file);
 			}
 
-			if (!vm_claim_page(upage)) {
-				free(new_file_loader);
+			if (!vm_alloc_page_with_initializer(type, upage, writable, init, new_file_loader)
+					|| !vm_claim_page(upage)) {
+				if (new_file_loader != NULL) {
+					file_close(new_file_loader->file);
+					free(new_file_loader);
+				}
 				return false;
 			}
 		}
 		else if (now_type == VM_FILE) {
+			/* Give the child a private copy; frames are never shared. */
 			struct segment *file_aux = malloc(sizeof(struct segment));
 			file_aux->file = parent_page->file.file;
 			file_aux->ofs = parent_page->file.ofs;
 			file_aux->page_read_bytes = parent_page->file.page_read_bytes;
 			file_aux->page_zero_bytes = parent_page->file.page_zero_bytes;
-			if (!vm_alloc_page_with_initializer(type, upage, writable, NULL, file_aux)) {
+			if (!vm_alloc_page_with_initializer(type, upage, writable, lazy_load_segment, file_aux)) {
 				free(file_aux);
 				return false;
 			}
-	
+			if (!vm_claim_page(upage)) {
+				return false;
+			}
 			struct page *file_page = spt_find_page(dst, upage);
-			file_backed_initializer(file_page, type, NULL);
-			file_page->frame = parent_page->frame;
-			pml4_set_page(thread_current()->pml4, file_page->va, parent_page->frame->kva, parent_page->writable);
-			// continue;
+			file_page->mapped_page_count = parent_page->mapped_page_count;
+			if (parent_page->frame != NULL) {
+				memcpy(file_page->frame->kva, parent_page->frame->kva, PGSIZE);
+			}
+		}
+		else if (parent_page->ksm != NULL) {
+			/* Merged by ksmd: map the same frame. */
+			if (!vm_alloc_page(type, upage, writable)) {
+				return false;
+			}
+			struct page *child_page = spt_find_page(dst, upage);
+			anon_initializer(child_page, type, NULL);
+			if (!ksm_map(child_page, parent_page->ksm)) {
+				return false;
+			}
+		}
+		else if (parent_page->frame == NULL) {
+			/* Swapped out: share the parent's swap slot.  A page
+			 * discarded by madvise() has none and reads back as zeros
+			 * in the child too. */
+			if (!vm_alloc_page(type, upage, writable)) {
+				return false;
+			}
+			struct page *child_page = spt_find_page(dst, upage);
+			anon_initializer(child_page, type, NULL);
+			if (parent_page->anon.slot_no != -1) {
+				anon_share_slot(child_page, parent_page);
+			}
 		}
 		else {
 			if (!vm_alloc_page(type, upage, writable)) {
@@ -454,5 +1266,14 @@ void
 supplemental_page_table_kill (struct supplemental_page_table *spt UNUSED) {
 	/* TODO: Destroy all the supplemental_page_table hold by thread and
 	 * TODO: writeback all the modified contents to the storage. */
+	file_backed_sync_all(spt);
 	hash_clear(&spt->spt_hash, page_kill);
+
+	/* Kernel threads exit without ever setting up a table. */
+	if (spt->mm_elem.next != NULL) {
+		lock_acquire(&mm_list_lock);
+		list_remove(&spt->mm_elem);
+		lock_release(&mm_list_lock);
+		spt->mm_elem.next = NULL;
+	}
 }
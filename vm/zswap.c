@@ -0,0 +1,374 @@
+/* zswap.c: Compressed in-memory cache in front of the swap disk.
+ *
+ * anon_swap_out() offers each page here before writing it to its swap
+ * slot.  Pages that are filled with one repeated word are kept as that
+ * word; others are LZSS-compressed and kept in malloc()'s size-class
+ * arenas if they shrink to at most ZSWAP_MAX_LEN bytes.  Entries are
+ * keyed by the swap slot the page was given, so a slot is always
+ * reserved on disk and an entry can be written back there at any time.
+ * When the pool exceeds zswap_max_pct of the user pool, the least
+ * recently stored entries are written back to disk.  Writeback does the
+ * disk I/O without zswap_lock; the entry stays in the map, marked busy,
+ * until it is on disk, so loads still find it meanwhile. */
+
+#include "vm/zswap.h"
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Largest compressed size worth keeping.  Bigger blocks would take a
+ * whole page from malloc() and save nothing. */
+#define ZSWAP_MAX_LEN (PGSIZE / 4)
+
+/* One compressed page. */
+struct zswap_entry {
+	struct hash_elem elem;              /* Element in zswap_map. */
+	struct list_elem lru_elem;          /* Element in zswap_lru. */
+	size_t slot_no;                     /* Swap slot backing this page. */
+	size_t len;                         /* Compressed length, 0 if same-filled. */
+	uint64_t fill;                      /* Repeated word if same-filled. */
+	uint8_t *data;                      /* Compressed bytes, or NULL. */
+	bool busy;                          /* Being written back to disk. */
+};
+
+unsigned zswap_max_pct = 20;
+
+static struct hash zswap_map;           /* Entries by slot_no. */
+static struct list zswap_lru;           /* Oldest entry at the front. */
+static struct lock zswap_lock;
+static struct condition zswap_written;  /* A busy entry went to disk. */
+static struct lock writeback_lock;      /* Serializes writeback_buf. */
+static zswap_writeback_func *zswap_writeback;
+static size_t pool_limit;               /* Max bytes in the pool. */
+static size_t pool_bytes;               /* Bytes held by stored entries. */
+static uint8_t *zswap_buf;              /* Compression buffer. */
+static uint8_t *writeback_buf;          /* Writeback buffer. */
+
+/* Statistics. */
+static long long stored_cnt, same_filled_cnt, reject_cnt;
+static long long hit_cnt, miss_cnt, writeback_cnt;
+static long long orig_bytes, comp_bytes;
+
+static uint64_t zswap_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool zswap_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED);
+static struct zswap_entry *zswap_find (size_t slot_no);
+static void zswap_evict (size_t slot_no);
+static void zswap_write_oldest (void);
+static void zswap_expand (const struct zswap_entry *entry, void *kva);
+static void zswap_drop (struct zswap_entry *entry);
+static size_t block_size (size_t len);
+static bool same_filled (const void *kva, uint64_t *fill);
+static size_t lz_compress (const uint8_t *src, uint8_t *dst, size_t limit);
+static void lz_decompress (const uint8_t *src, size_t len, uint8_t *dst);
+
+/* Sets up the compressed pool.  WRITEBACK is used to push entries out
+ * to their swap slots when the pool is full. */
+void
+zswap_init (zswap_writeback_func *writeback) {
+	hash_init (&zswap_map, zswap_hash, zswap_less, NULL);
+	list_init (&zswap_lru);
+	lock_init (&zswap_lock);
+	cond_init (&zswap_written);
+	lock_init (&writeback_lock);
+	zswap_writeback = writeback;
+
+	if (zswap_max_pct > 100)
+		zswap_max_pct = 100;
+	pool_limit = palloc_pool_size (PAL_USER) * PGSIZE / 100 * zswap_max_pct;
+	if (pool_limit > 0) {
+		zswap_buf = palloc_get_page (PAL_ASSERT);
+		writeback_buf = palloc_get_page (PAL_ASSERT);
+	}
+}
+
+/* Tries to keep the page at KVA, destined for SLOT_NO, in the pool.
+ * Returns false if the page should go to disk instead. */
+bool
+zswap_store (size_t slot_no, const void *kva) {
+	if (pool_limit == 0)
+		return false;
+
+	struct zswap_entry *entry = malloc (sizeof *entry);
+	if (entry == NULL)
+		return false;
+	entry->slot_no = slot_no;
+	entry->len = 0;
+	entry->data = NULL;
+	entry->busy = false;
+
+	lock_acquire (&zswap_lock);
+	if (same_filled (kva, &entry->fill)) {
+		same_filled_cnt++;
+	} else {
+		entry->len = lz_compress (kva, zswap_buf, ZSWAP_MAX_LEN);
+		if (entry->len != 0)
+			entry->data = malloc (entry->len);
+		if (entry->data == NULL) {
+			reject_cnt++;
+			lock_release (&zswap_lock);
+			free (entry);
+			return false;
+		}
+		memcpy (entry->data, zswap_buf, entry->len);
+	}
+
+	/* Make room by writing the oldest entries back to disk. */
+	pool_bytes += block_size (entry->len);
+	while (pool_bytes > pool_limit && !list_empty (&zswap_lru))
+		zswap_write_oldest ();
+
+	/* The slot was just allocated, so any entry still keyed by it is
+	 * stale. */
+	zswap_evict (slot_no);
+	struct hash_elem *old = hash_insert (&zswap_map, &entry->elem);
+	ASSERT (old == NULL);
+	list_push_back (&zswap_lru, &entry->lru_elem);
+	stored_cnt++;
+	orig_bytes += PGSIZE;
+	comp_bytes += entry->len;
+	lock_release (&zswap_lock);
+	return true;
+}
+
+/* Copies the page kept for SLOT_NO into KVA.  Returns false if the
+ * page is not in the pool and must be read from disk. */
+bool
+zswap_load (size_t slot_no, void *kva) {
+	if (pool_limit == 0)
+		return false;
+
+	lock_acquire (&zswap_lock);
+	struct zswap_entry *entry = zswap_find (slot_no);
+	if (entry == NULL) {
+		miss_cnt++;
+		lock_release (&zswap_lock);
+		return false;
+	}
+
+	zswap_expand (entry, kva);
+	hit_cnt++;
+	lock_release (&zswap_lock);
+	return true;
+}
+
+/* Forgets the page kept for SLOT_NO, if any.  Called when the slot is
+ * freed, before it can be handed out again.  Waits for a writeback of
+ * the entry to finish, so it cannot land on the slot's next owner. */
+void
+zswap_invalidate (size_t slot_no) {
+	if (pool_limit == 0)
+		return;
+
+	lock_acquire (&zswap_lock);
+	zswap_evict (slot_no);
+	lock_release (&zswap_lock);
+}
+
+/* Prints compressed pool statistics. */
+void
+zswap_print_stats (void) {
+	if (pool_limit == 0)
+		return;
+	printf ("Zswap: %lld stored (%lld same-filled, %lld rejected), "
+			"%lld%% compressed size, %lld hits, %lld misses, "
+			"%lld written back\n",
+			stored_cnt, same_filled_cnt, reject_cnt,
+			orig_bytes ? comp_bytes * 100 / orig_bytes : 0,
+			hit_cnt, miss_cnt, writeback_cnt);
+}
+
+static uint64_t
+zswap_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct zswap_entry *entry = hash_entry (e, struct zswap_entry, elem);
+	return hash_bytes (&entry->slot_no, sizeof entry->slot_no);
+}
+
+static bool
+zswap_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct zswap_entry, elem)->slot_no
+		< hash_entry (b, struct zswap_entry, elem)->slot_no;
+}
+
+/* Returns the entry for SLOT_NO, or NULL.  Caller holds zswap_lock. */
+static struct zswap_entry *
+zswap_find (size_t slot_no) {
+	struct zswap_entry key;
+	struct hash_elem *e;
+
+	key.slot_no = slot_no;
+	e = hash_find (&zswap_map, &key.elem);
+	return e != NULL ? hash_entry (e, struct zswap_entry, elem) : NULL;
+}
+
+/* Removes the entry for SLOT_NO, if any, waiting out its writeback.
+ * Caller holds zswap_lock. */
+static void
+zswap_evict (size_t slot_no) {
+	struct zswap_entry *entry;
+
+	while ((entry = zswap_find (slot_no)) != NULL && entry->busy)
+		cond_wait (&zswap_written, &zswap_lock);
+	if (entry != NULL)
+		zswap_drop (entry);
+}
+
+/* Writes the least recently stored entry back to its swap slot and
+ * frees it.  Caller holds zswap_lock, which is released around the
+ * disk write. */
+static void
+zswap_write_oldest (void) {
+	struct zswap_entry *old = list_entry (list_pop_front (&zswap_lru),
+			struct zswap_entry, lru_elem);
+
+	old->busy = true;
+	pool_bytes -= block_size (old->len);
+	lock_release (&zswap_lock);
+
+	/* A busy entry is only freed here, so its data stays put. */
+	lock_acquire (&writeback_lock);
+	zswap_expand (old, writeback_buf);
+	zswap_writeback (old->slot_no, writeback_buf);
+	lock_release (&writeback_lock);
+
+	lock_acquire (&zswap_lock);
+	writeback_cnt++;
+	hash_delete (&zswap_map, &old->elem);
+	free (old->data);
+	free (old);
+	cond_broadcast (&zswap_written, &zswap_lock);
+}
+
+/* Restores the page held by ENTRY into KVA. */
+static void
+zswap_expand (const struct zswap_entry *entry, void *kva) {
+	if (entry->data == NULL) {
+		uint64_t *p = kva;
+		for (size_t i = 0; i < PGSIZE / sizeof *p; i++)
+			p[i] = entry->fill;
+	} else
+		lz_decompress (entry->data, entry->len, kva);
+}
+
+/* Removes ENTRY from the pool and frees it.  Caller holds zswap_lock. */
+static void
+zswap_drop (struct zswap_entry *entry) {
+	hash_delete (&zswap_map, &entry->elem);
+	list_remove (&entry->lru_elem);
+	pool_bytes -= block_size (entry->len);
+	free (entry->data);
+	free (entry);
+}
+
+/* Bytes malloc() actually sets aside for a LEN-byte block, plus the
+ * entry itself. */
+static size_t
+block_size (size_t len) {
+	size_t size = 16;
+	while (len != 0 && size < len)
+		size *= 2;
+	return (len != 0 ? size : 0) + sizeof (struct zswap_entry);
+}
+
+/* Returns true if the page at KVA is one 64-bit word repeated, and
+ * stores that word in *FILL. */
+static bool
+same_filled (const void *kva, uint64_t *fill) {
+	const uint64_t *p = kva;
+	for (size_t i = 1; i < PGSIZE / sizeof *p; i++)
+		if (p[i] != p[0])
+			return false;
+	*fill = p[0];
+	return true;
+}
+
+/* LZSS over a single page.  Output is a sequence of groups: one flag
+ * byte, then up to 8 items.  A clear flag bit is a literal byte; a set
+ * bit is a 2-byte back-reference holding a 12-bit distance - 1 and a
+ * 4-bit length - LZ_MIN_MATCH. */
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15)
+#define LZ_HASH_BITS 10
+#define LZ_NONE 0xffff
+
+static uint16_t lz_head[1 << LZ_HASH_BITS];   /* Last position per hash. */
+
+static inline unsigned
+lz_hash (const uint8_t *p) {
+	unsigned v = p[0] | p[1] << 8 | p[2] << 16;
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Compresses the page at SRC into DST.  Returns the compressed length,
+ * or 0 if it would exceed LIMIT bytes.  Caller holds zswap_lock, which
+ * protects lz_head. */
+static size_t
+lz_compress (const uint8_t *src, uint8_t *dst, size_t limit) {
+	size_t ip = 0, op = 0, flag_pos = 0;
+	int bit = 8;
+
+	memset (lz_head, 0xff, sizeof lz_head);
+	while (ip < PGSIZE) {
+		if (bit == 8) {
+			if (op >= limit)
+				return 0;
+			flag_pos = op++;
+			dst[flag_pos] = 0;
+			bit = 0;
+		}
+
+		size_t len = 0, dist = 0;
+		if (ip + LZ_MIN_MATCH <= PGSIZE) {
+			unsigned h = lz_hash (src + ip);
+			size_t cand = lz_head[h];
+			lz_head[h] = ip;
+			if (cand != LZ_NONE) {
+				size_t max = PGSIZE - ip < LZ_MAX_MATCH ? PGSIZE - ip : LZ_MAX_MATCH;
+				while (len < max && src[cand + len] == src[ip + len])
+					len++;
+				dist = ip - cand;
+			}
+		}
+
+		if (len >= LZ_MIN_MATCH) {
+			if (op + 2 > limit)
+				return 0;
+			dst[flag_pos] |= 1 << bit;
+			dst[op++] = (dist - 1) & 0xff;
+			dst[op++] = ((dist - 1) >> 8) << 4 | (len - LZ_MIN_MATCH);
+			ip += len;
+		} else {
+			if (op + 1 > limit)
+				return 0;
+			dst[op++] = src[ip++];
+		}
+		bit++;
+	}
+	return op;
+}
+
+/* Expands LEN bytes of lz_compress() output at SRC into the page DST. */
+static void
+lz_decompress (const uint8_t *src, size_t len, uint8_t *dst) {
+	size_t ip = 0, op = 0;
+
+	while (ip < len && op < PGSIZE) {
+		uint8_t flags = src[ip++];
+		for (int bit = 0; bit < 8 && ip < len && op < PGSIZE; bit++) {
+			if (flags & (1 << bit)) {
+				size_t dist = (src[ip] | (src[ip + 1] >> 4) << 8) + 1;
+				size_t n = (src[ip + 1] & 0xf) + LZ_MIN_MATCH;
+				ip += 2;
+				for (; n > 0 && op < PGSIZE; n--, op++)
+					dst[op] = dst[op - dist];
+			} else
+				dst[op++] = src[ip++];
+		}
+	}
+}